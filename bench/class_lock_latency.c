@@ -0,0 +1,105 @@
+/*
+Size class lock benchmark: the latency of malloc/free pairs at a few thread counts.
+Each thread keeps 64 blocks of 16 to 500 bytes alive and replaces one of them per operation, timing each free+malloc pair.
+The percentiles of a single run move a lot with scheduling noise, so every thread count is run ROUNDS times and the median of
+each percentile is reported. The thread counts can be given as arguments.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "../mtmm.h"
+
+#define OPERATIONS 200000			/*per thread*/
+#define LIVE_BLOCKS 64
+#define ROUNDS 7
+#define MAX_THREADS 256
+#define PERCENTILES 4
+
+static unsigned long *latencies;
+
+static inline unsigned long now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static void * worker(void *arg)
+{
+	unsigned long *latency = latencies + (long)arg * OPERATIONS;
+	void *blocks[LIVE_BLOCKS] = {NULL};
+	unsigned long i, start;
+	for(i = 0; i < OPERATIONS; i++)
+	{
+		start = now_ns();
+		free(blocks[i % LIVE_BLOCKS]);
+		blocks[i % LIVE_BLOCKS] = malloc(16 + (i * 7) % 500);
+		latency[i] = now_ns() - start;
+	}
+	for(i = 0; i < LIVE_BLOCKS; i++)
+		free(blocks[i]);
+	return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+/*run the threads once, and fill in the p50, p99, p99.9 and p99.99 latencies*/
+static void run(int threads, unsigned long *percentiles)
+{
+	pthread_t ids[MAX_THREADS];
+	size_t n = (size_t)threads * OPERATIONS;
+	long i;
+	for(i = 0; i < threads; i++)
+		pthread_create(&ids[i], NULL, worker, (void *)i);
+	for(i = 0; i < threads; i++)
+		pthread_join(ids[i], NULL);
+	qsort(latencies, n, sizeof(unsigned long), compare);
+	percentiles[0] = latencies[n / 2];
+	percentiles[1] = latencies[n * 99 / 100];
+	percentiles[2] = latencies[n * 999 / 1000];
+	percentiles[3] = latencies[n * 9999 / 10000];
+}
+
+int main(int argc, char *argv[])
+{
+	int defaults[] = {1, 4, 16, 64};
+	int counts = argc > 1 ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+	unsigned long results[PERCENTILES][ROUNDS];
+	int c, r, p;
+	latencies = malloc(sizeof(unsigned long) * MAX_THREADS * OPERATIONS);
+	if(latencies == NULL)
+	{
+		perror(NULL);
+		return 1;
+	}
+	printf("threads     p50     p99   p99.9  p99.99(ns, median of %d runs)\n", ROUNDS);
+	for(c = 0; c < counts; c++)
+	{
+		int threads = argc > 1 ? atoi(argv[c + 1]) : defaults[c];
+		unsigned long percentiles[PERCENTILES];
+		if(threads < 1 || threads > MAX_THREADS)
+		{
+			fprintf(stderr, "thread counts are 1 to %d\n", MAX_THREADS);
+			return 1;
+		}
+		for(r = 0; r < ROUNDS; r++)
+		{
+			run(threads, percentiles);
+			for(p = 0; p < PERCENTILES; p++)
+				results[p][r] = percentiles[p];
+		}
+		printf("%7d", threads);
+		for(p = 0; p < PERCENTILES; p++)
+		{
+			qsort(results[p], ROUNDS, sizeof(unsigned long), compare);
+			printf(" %7lu", results[p][ROUNDS / 2]);
+		}
+		printf("\n");
+	}
+	return 0;
+}
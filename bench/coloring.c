@@ -0,0 +1,127 @@
+/*
+Coloring benchmark: the L1 data cache misses of reading one hot object in each of many superblocks.
+The first 4 KiB block of 256 superblocks is taken and its first lines are read over and over. The same reads are then made
+from a control region laid out the way superblocks were before coloring, with every hot object at the same offset of a
+SUPERBLOCK_SIZE stride, so their lines fall into the same cache sets.
+The misses are read with perf_event_open(). Where the hardware counters aren't available(e.g. in most VMs) only the
+average read time is reported.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../mtmm.h"
+
+#define SUPERBLOCKS 256
+#define OBJECT_SIZE 4096
+#define OBJECTS_PER_SUPERBLOCK (SUPERBLOCK_SIZE / OBJECT_SIZE - 1)	/*the header takes the space of one*/
+#define ROUNDS 20000
+#define REPEATS 9				/*the fastest of these is reported, the rest were disturbed by other work*/
+#define CACHE_LINE 64
+
+static double now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/*returns a counter of the calling thread's L1 data cache read misses, or -1*/
+static int open_l1_misses()
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void measure(const char *name, char **objects, int lines, int counter)
+{
+	volatile long sum = 0;
+	long long misses, fewest = -1;
+	double elapsed, fastest = 0;
+	int i, r, s, l;
+	for(i = 0; i < REPEATS; i++)
+	{
+		if(counter >= 0)
+		{
+			ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		double start = now_ns();
+		for(r = 0; r < ROUNDS; r++)
+		{
+			for(s = 0; s < SUPERBLOCKS; s++)
+			{
+				for(l = 0; l < lines; l++)
+					sum += objects[s][l * CACHE_LINE];
+			}
+		}
+		elapsed = now_ns() - start;
+		if(i == 0 || elapsed < fastest)
+			fastest = elapsed;
+		if(counter >= 0)
+		{
+			ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+			if(read(counter, &misses, sizeof(misses)) == sizeof(misses) && (fewest < 0 || misses < fewest))
+				fewest = misses;
+		}
+	}
+	printf("%-10s %d line(s) per object: %.2f ns per read", name, lines, fastest / ((double)ROUNDS * SUPERBLOCKS * lines));
+	if(fewest >= 0)
+		printf(", %.3f L1D misses per read", (double)fewest / ((double)ROUNDS * SUPERBLOCKS * lines));
+	printf("\n");
+}
+
+int main()
+{
+	static char *objects[SUPERBLOCKS][OBJECTS_PER_SUPERBLOCK];	/*kept reachable, so the compiler can't drop the allocations*/
+	static char *colored[SUPERBLOCKS], *uncolored[SUPERBLOCKS];
+	int s, j, lines;
+	/*a superblock of the class is filled before the next one is taken, so each round of allocations starts a new one*/
+	for(s = 0; s < SUPERBLOCKS; s++)
+	{
+		for(j = 0; j < OBJECTS_PER_SUPERBLOCK; j++)
+		{
+			objects[s][j] = malloc(OBJECT_SIZE);
+			if(objects[s][j] == NULL)
+			{
+				perror(NULL);
+				return 1;
+			}
+			memset(objects[s][j], 1, OBJECT_SIZE);
+		}
+		colored[s] = objects[s][0];
+	}
+	char *control = mmap(NULL, (size_t)SUPERBLOCKS * SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(control == MAP_FAILED)
+	{
+		perror(NULL);
+		return 1;
+	}
+	for(s = 0; s < SUPERBLOCKS; s++)
+	{
+		uncolored[s] = control + (size_t)s * SUPERBLOCK_SIZE + (uintptr_t)colored[0] % SUPERBLOCK_SIZE;
+		memset(uncolored[s], 1, OBJECT_SIZE);
+	}
+	int counter = open_l1_misses();
+	if(counter < 0)
+		perror("perf_event_open(L1D read misses), only timing");
+	for(lines = 1; lines <= 2; lines++)
+	{
+		measure("colored", colored, lines, counter);
+		measure("uncolored", uncolored, lines, counter);
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+Meshing benchmark: the RSS a fragmented heap gives back with mtmm_mesh(), and what fork() costs with and without the mesh arena.
+64 MiB of 256 byte blocks are allocated and all but about 1 in 50 freed, at random, so the superblocks are sparse.
+Each configuration runs in its own process, since the tunables are read when the library is loaded.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../mtmm.h"
+
+#define BLOCK_SIZE 256
+#define BLOCKS ((64UL << 20) / BLOCK_SIZE)
+#define FORKS 20
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static long rss_kib()
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f != NULL)
+	{
+		if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void run(const char *conf)
+{
+	static char *blocks[BLOCKS];
+	unsigned long i;
+	double start;
+	int status;
+	srandom(1);
+	for(i = 0; i < BLOCKS; i++)
+	{
+		blocks[i] = malloc(BLOCK_SIZE);
+		memset(blocks[i], 1, BLOCK_SIZE);
+	}
+	long full = rss_kib();
+	for(i = 0; i < BLOCKS; i++)
+	{
+		if(random() % 50 != 0)
+			free(blocks[i]);
+	}
+	long fragmented = rss_kib();
+	/*a pass looks at a few superblocks per class, passes are repeated until one releases nothing*/
+	size_t released = 0, pass;
+	while((pass = mtmm_mesh()) != 0)
+		released += pass;
+	long meshed = rss_kib();
+	start = now();
+	for(i = 0; i < FORKS; i++)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
+			_exit(0);
+		waitpid(pid, &status, 0);
+	}
+	printf("%-24s RSS full %6ld KiB, fragmented %6ld KiB, after mtmm_mesh %6ld KiB(%zu KiB released), fork+exit+wait %.3f ms\n",
+		conf, full, fragmented, meshed, released / 1024, (now() - start) * 1000 / FORKS);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *confs[] = {"mesh:0", "mesh:1,mesh_interval:0"};
+	unsigned int c;
+	int status;
+	if(argc > 1)
+	{
+		run(argv[1]);
+		return 0;
+	}
+	for(c = 0; c < sizeof(confs) / sizeof(confs[0]); c++)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if(pid == 0)
+		{
+			setenv("MTMM_CONF", confs[c], 1);
+			execl("/proc/self/exe", argv[0], confs[c], (char *)NULL);
+			_exit(1);
+		}
+		waitpid(pid, &status, 0);
+	}
+	return 0;
+}
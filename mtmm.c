@@ -2,12 +2,23 @@
 This module implements memory allocation with several CPUS(Hoard)
 Each CPU has it's own heap which is composed of "superblocks"
 There are size classes, which define the size of the blocks. Each superblock belongs to a size class and all it's blocks are of the same size.
-There's also a global heap, used to store underpopulated superblocks. If a heap drops below a certain percentage of efficency, represented by the following invariant, a superblock is moved to the global heap in order to restore the invariant.
+All superblocks are carved from one reserved virtual range. Their headers are kept apart from their blocks, in a dense array indexed by the superblock's number in the range.
+There's also a global heap, used to store underpopulated superblocks. It is split into several independently locked shards, and every CPU heap uses its nearest shard first. If a heap drops below a certain percentage of efficency, represented by the following invariant, a superblock is moved to the global heap in order to restore the invariant.
 The invariant is: u > (1-f)a OR u > a - K*S, where u is the amount of allocated memory, a is the total amount of memory, f is the allowed empty fraction of the memory, K is a constant and S is the size of a superblock.
-If the user needs a "large" block(more than half the size of a superblock), the allocation is done directly with the OS.
+If the user needs a "large" block(more than half the size of a superblock), it gets a run of whole pages carved from a big reserved span. Free runs are coalesced with their neighbours and kept in bins by size for best fit. Only blocks too big for a span are allocated directly with the OS.
+Blocks have no header: a radix tree maps every page the allocator owns to its superblock, page run or large mapping, and free() finds the block's size and owner there. Pointers the allocator doesn't own aren't in the map, so they are detected and ignored.
+Superblocks that become completely empty leave their size class for a class independent pool, and are formatted again for whichever class needs a superblock next. Superblocks that stay in the pool longer than the decay time have their pages returned to the OS.
+Optionally, a background thread does the housekeeping off the hot paths: it purges the pool, keeps a few empty superblocks prefaulted and trims heaps that went idle.
+Optionally, a pool of superblocks is reserved and locked in memory at start, for threads that can't take a page fault in malloc.
+Optionally, superblocks come from a memfd backed arena, and sparse superblocks of the same class whose live blocks don't overlap are "meshed":
+the blocks of one are copied into the other, and its virtual pages are remapped onto the other's physical pages, so memory is returned without moving any object.
 */ 
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -17,46 +28,137 @@ If the user needs a "large" block(more than half the size of a superblock), the
 #include <pthread.h>
 #include <math.h>
 #include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define SINGLE_THREADED() (__libc_single_threaded)	/*glibc clears it before the process' second thread starts*/
+#else
+#define SINGLE_THREADED() 0
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "mtmm.h"
 
 #define NUM_OF_CLASSES 16
+/*the defaults of the runtime tunables(see MTMM_CONF in mtmm.h)*/
 #define NUM_OF_CPUS 2
-#define NUM_OF_HEAPS NUM_OF_CPUS + 1
+#define MAX_HEAPS 32				/*the number of CPU heaps threads may be spread over as contention grows*/
+#define HEAP_GROW_CONTENTION 256		/*the busy heap locks within HEAP_GROW_WINDOW that add a CPU heap*/
+#define STEAL_FRACTION 0.5			/*a sibling heap's superblock may be stolen if at most this fraction of its blocks is used*/
+#define HEAP_GROW_WINDOW 100			/*the time(ms) busy heap locks are counted over*/
 #define SIZE_THRESHOLD SUPERBLOCK_SIZE/2
 #define F 0.4					/*the empty fraction allowed in the invariant*/
 #define K 0					/*the min number of superblocks in the invariant*/
+#define TCACHE_SIZE 0				/*the max number of blocks per class in a thread's cache(0 disables it)*/
+#define PURGE_DECAY 10000			/*the time(ms) an empty superblock is kept before its pages are purged*/
+#define TARGET_FRACTION -1			/*the empty fraction a heap is brought back to once it breaks the invariant, half of f unless it's given*/
+#define RESERVE 2				/*the number of superblocks a size class keeps regardless of the invariant*/
+#define NUM_OF_POOLS 4				/*the number of shards the global heap is split into*/
+#define MAX_OF_CPUS 64				/*the upper bound of the "heaps" tunable*/
+#define MAX_OF_POOLS 16				/*the upper bound of the "pools" tunable*/
+#define MESH 0					/*whether superblocks come from the meshable arena*/
+#define MESH_INTERVAL 1000			/*the time(ms) between automatic mesh passes(0 for on demand passes only)*/
+#define SAMPLE_INTERVAL 524288			/*the average number of bytes a thread allocates between sampled allocations*/
+#define BACKGROUND 0				/*the time(ms) between the background thread's passes(0 disables the thread)*/
+#define PREFAULT 4				/*the number of empty superblocks the background thread keeps prefaulted*/
+#define LOCKED 0				/*the bytes of superblocks reserved and locked in memory at start(0 disables the locked pool)*/
+#define EXHAUSTED EXHAUST_FAIL			/*what an allocation does once the locked pool is used up*/
+#define EXHAUST_FAIL 0				/*the policies of the exhausted tunable: return NULL with errno set to ENOMEM,*/
+#define EXHAUST_GROW 1				/*take memory from the OS as without a locked pool,*/
+#define EXHAUST_ABORT 2				/*or abort the process*/
+#define SAMPLE_BITS 13
+#define SAMPLE_SLOTS (1 << SAMPLE_BITS)		/*the size of the table of sampled allocations*/
+/*the first table slot of a sampled block. The address is mixed(Fibonacci hashing), page aligned and superblock strided blocks would share a few slots*/
+#define SAMPLE_SLOT(block) ((unsigned int)((((unsigned long)(block) >> 4) * 0x9E3779B97F4A7C15UL) >> (64 - SAMPLE_BITS)))
+#define SAMPLE_PROBES 16			/*the number of table slots a sampled allocation may be kept in*/
+#define ARENA_ALIGNMENT 16			/*the alignment of an arena's allocations*/
+#define LOCK_SPINS 100				/*the number of times a class lock is polled before its waiter sleeps*/
+#define LOCK_INITIALIZER {0}
+#define RETIRE_BATCH 64				/*the number of blocks a thread retires between attempts to advance the epoch*/
+#define RETIRE_GROUPS (2*RETIRE_BATCH)		/*the hash slots reclaiming a batch groups its blocks by superblock in*/
+#define LIMBO_LISTS 3				/*a thread's retired blocks are kept by epoch modulo this(see mtmm_retire)*/
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MAP_BITS 12			/*the page number(36 bits of a 48 bit address) is split into 3 levels of this many bits*/
+#define PAGE_MAP_FANOUT (1UL << PAGE_MAP_BITS)
+#define PAGE_SUPERBLOCK 1UL			/*the kinds of page map entries, kept in the low bits of the record's address*/
+#define PAGE_RUN 2UL
+#define PAGE_LARGE 3UL
+#define PAGE_ENTRY(record, kind) ((unsigned long)(record) | (kind))
+#define PAGE_KIND(entry) ((entry) & 3)
+#define PAGE_RECORD(entry) ((void *)((entry) & ~3UL))
+#define MIN_CLASS 4				/*the smallest class, its blocks can hold a cache link and keep 16 byte alignment*/
+#define MIN_BLOCK_SIZE SIZE_OF_CLASS(MIN_CLASS)
+#define MEDIUM_SPAN_SIZE (32UL << 20)		/*the size of the spans "large" blocks are carved from*/
+#define MEDIUM_MAX_SIZE (4UL << 20)		/*blocks larger than this are mapped directly from the OS*/
+#define MEDIUM_DIRTY_PAGES 512			/*the free runs' pages are returned to the OS once more than this many pages were freed into them*/
+#define MEDIUM_BINS 128				/*free runs shorter than this many pages have a bin per length, longer ones share the last bin*/
+#define RUN_PAGES(sz) (((sz) + sizeof(runHeader) + PAGE_SIZE - 1) / PAGE_SIZE)	/*the number of pages in the run of a block*/
+#define RUN_BIN(pages) ((pages) < MEDIUM_BINS ? (pages) : MEDIUM_BINS - 1)
+#define REGION_SIZE (32UL << 30)		/*the size of the virtual range superblocks come from, a smaller one is used if it can't be reserved*/
+#define REGION_SLOTS (REGION_SIZE / SUPERBLOCK_SIZE)
+#define MIN_REGION_SIZE (256UL << 20)		/*the smallest virtual range tried*/
+#define REGION_CHUNK 64				/*the number of slots made accessible at once(see open_slots)*/
+#define MESH_CANDIDATES 32			/*the max number of superblocks of a class considered in one mesh pass*/
+#define BITMAP_WORDS (SUPERBLOCK_SIZE / MIN_BLOCK_SIZE / 64)	/*the size of a superblock's free blocks bitmap*/
+#define BITMAP_OF(sb) (sbRegion.bitmaps[SLOT_OF(sb)])
+#define IN_REGION(p) ((char *)(p) >= sbRegion.base && (char *)(p) < SLOT_DATA(__atomic_load_n(&(sbRegion.openSlots), __ATOMIC_RELAXED)))	/*in the accessible slots*/
+#define MESHING_ENABLED (meshSpace.fd != -1)
+#define ALIASES_OF(sb) (MESHING_ENABLED ? meshSpace.aliases[SLOT_OF(sb)] : 0)	/*the number of slots mapped onto a superblock's pages*/
+#define SLOT_OF(sb) ((unsigned int)((sb) - sbRegion.headers))	/*the superblock's number*/
+#define SLOT_DATA(slot) (sbRegion.base + (unsigned long)(slot) * SUPERBLOCK_SIZE)
+#define DATA_OF(sb) SLOT_DATA(SLOT_OF(sb))	/*the superblock's blocks area*/
+#define BLOCK_AT(sb, index, stride) ((freeBlock *)(DATA_OF(sb) + (sb)->color + (index)*(stride)))
+/*the offset of a block from the superblock's first block, and its index. A block of a meshed superblock may be reached through an alias, a whole number of superblocks away*/
+#define BLOCK_OFFSET(sb, block) ((unsigned long)((char *)(block) - DATA_OF(sb)) % SUPERBLOCK_SIZE - (sb)->color)
+#define BLOCK_INDEX(sb, block, stride) (BLOCK_OFFSET(sb, block) / (stride))
+#define CACHE_LINE 64				/*the unit of the superblocks' coloring offsets*/
+#define TEST_BIT(bitmap, i) (((bitmap)[(i)/64] >> ((i)%64)) & 1)
 #define SIZE_OF_CLASS(class) (1<<(class)) 	/*claculates the block size of a class(2^class)*/
 #define EXIT(error) {printf(error); exit(1);}
-#define HASH(id) (id)%NUM_OF_CPUS		/*the hash functions used for choosing a heap*/
+#define INIT_EXIT(error) {(void)!write(STDERR_FILENO, error, strlen(error)); _exit(1);}	/*stdio may allocate, while init() holds initOnce or a forked child holds the locks its fork handlers took*/
+#define HASH(id) (id)%__atomic_load_n(&activeHeaps, __ATOMIC_RELAXED)	/*the hash functions used for choosing a heap*/
+#define NEAREST_POOL(heap) ((heap)->id % config.numOfPools)	/*the global heap shard a CPU heap uses first*/
+#define IS_GLOBAL(heap) ((heap) >= globalPools && (heap) < globalPools + MAX_OF_POOLS)
+#define IS_PRIVATE(heap) ((heap)->isPrivate)	/*a heap made by mtmm_heap_create, its superblocks never move to another heap*/
 #define PPRINT(str) {printf(str); fflush(stdout);}
+/*a superblock's state word, updated with CAS: bits 0-15 are the number of used blocks and bit 16 freezes the superblock while it's meshed*/
+#define STATE_USED(state) ((state) & 0xFFFF)
+#define STATE_FROZEN (1U << 16)
+#define CHECK_INTERVAL(sbBlocks) ((sbBlocks)/4 + 1)	/*the number of frees to a class between invariant checks*/
 
-/*TODO Remove inUse?*/
-typedef struct sBlockHeader
+/*a block in a thread's cache. Blocks have no header, the link is kept in the block itself while it's cached*/
+typedef struct sFreeBlock
 {
-	unsigned int blockSize;			/*the size of the block*/ 	
-	int inUse;				/*is the block used*/
-	
-	struct sBlockHeader *next;		/*the next block in the superblock*/
-	struct sSuperblockHeader *parentSuperblock; 	/*the block's superblock*/
-} blockHeader;
+	struct sFreeBlock *next;		/*the next cached block*/
+} freeBlock;
 
-typedef struct sBlockList
-{
-	blockHeader *head;			/*the first block in the list*/
-} blockList;
+_Static_assert(SUPERBLOCK_SIZE / MIN_BLOCK_SIZE < 65536, "the used blocks count must fit the state word");
 
-/*TODO Remove numOfBlocks*/
+/*the header of a superblock. The headers are kept apart from the superblocks' blocks, in an array indexed by the superblock's number(see sbRegion)*/
 typedef struct sSuperblockHeader
 {
-	unsigned int usedBlocks;		/*the number of used blocks in the superblock*/
+	unsigned int state;			/*the number of used blocks and the frozen bit(see STATE_USED), updated with CAS*/
+	unsigned int countedBlocks;		/*the used blocks the owning class counts for the superblock(protected by the class' lock)*/
 	unsigned int numOfBlocks;		/*the number of blocks in the superblock*/
-	blockList freeList;			/*the list of free blocks in the superblock*/
-	pthread_mutex_t lock;			/*the superblocks' lock*/
+	unsigned int class;			/*the size class the superblock is formatted for*/
+	unsigned int color;			/*the offset of the first block after the header(a multiple of CACHE_LINE)*/
+	unsigned int samples;			/*the number of the superblock's blocks in the sampled allocations table(updated atomically)*/
 
 	struct sSuperblockHeader *next;		/*the next superblock in the list*/
 	struct sSuperblockHeader *prev;		/*the previous superblock in the list*/
-	struct sHeap *parentHeap;		/*the superblock's heap*/
-} superblockHeader;
+	struct sHeap *parentHeap;		/*the superblock's heap, NULL while it's in the empty superblocks pool*/
+	unsigned long emptySince;		/*the time(ms) the superblock entered the empty superblocks pool*/
+	struct sSuperblockHeader *meshedInto;	/*the superblock this one was meshed into, NULL if it wasn't*/
+} __attribute__((aligned(CACHE_LINE))) superblockHeader;	/*a header per cache line, so frees to different superblocks don't contend on a line*/
+
+_Static_assert(sizeof(superblockHeader) == CACHE_LINE, "a superblock header must fit a cache line");
 
 typedef struct sSuperblockList
 {
@@ -64,40 +166,632 @@ typedef struct sSuperblockList
 	superblockHeader *tail;			/*the second superblock in the list*/
 } superblockList;
 
+/*A size class' lock. Critical sections are short, so a waiter polls the lock for a while(on a multi CPU machine) before it sleeps on a futex.
+It's 4 bytes instead of a pthread mutex's 40*/
+typedef struct sClassLock
+{
+	unsigned int state;			/*0 unlocked, 1 locked, 2 locked and a thread may be sleeping on it*/
+} classLock;
+
 typedef struct sSizeClass
 {
 	unsigned int size;			/*the size of the class*/
 	unsigned int usedBlocks;		/*the number of used blocks in the class*/
 	unsigned int numOfBlocks;		/*the number of blocks in the class*/
 	superblockList superblocks;		/*the class' superblocks, sorted by fullness*/
-	pthread_mutex_t lock;			/*the class' lock*/
+	classLock lock;				/*the class' lock*/
+	unsigned int pendingFrees;		/*the frees since the class' counters were last reconciled(updated atomically)*/
+	unsigned long transfersIn;		/*the number of superblocks moved into the class from another heap*/
+	unsigned long transfersOut;		/*the number of superblocks moved out of the class to another heap*/
+	unsigned long steals;			/*the number of superblocks the class took from the same class of a sibling CPU heap*/
 } sizeClass;
 
 typedef struct sHeap
 {
-	unsigned int id;			/*the id of the heap's CPU(NUM_OF_HEAPS-1 will always be the global heap's id)*/
+	unsigned int id;			/*the id of the heap's CPU, or the index of a global heap shard*/
+	int isPrivate;				/*whether the heap is the first member of a private heap(mtmm_heap_t)*/
+	unsigned int boundThreads;		/*the threads bound to the heap(see mtmm_thread_bind_heap), updated atomically*/
 	sizeClass classes[NUM_OF_CLASSES];	/*the size classes in the heap*/
 } memHeap;
 
-static int isInitialized = 0;			/*whether the data structure has been initialized*/
-static memHeap heaps[NUM_OF_HEAPS];		/*1 heap per CPU and 1 additional global heap*/
+typedef struct sConfig
+{
+	double emptyFraction;			/*the empty fraction allowed in the invariant(F), the low watermark*/
+	double targetFraction;			/*the empty fraction restored when the invariant breaks, the high watermark. Negative until init() derives it*/
+	unsigned int reserve;			/*the number of superblocks a size class keeps regardless of the invariant*/
+	unsigned int minSuperblocks;		/*the min number of superblocks in the invariant(K)*/
+	unsigned int numOfCpus;			/*the number of CPU heaps at start*/
+	unsigned int maxHeaps;			/*the number of CPU heaps contention may grow them to, the heaps past it are dedicated to threads*/
+	unsigned int numOfPools;		/*the number of global heap shards*/
+	size_t sizeThreshold;			/*allocations above this size go directly to the OS*/
+	unsigned int tcacheSize;		/*the max number of blocks per class in a thread's cache*/
+	unsigned int purgeDecay;		/*the time(ms) an empty superblock is kept before it's purged*/
+	unsigned int mesh;			/*whether superblocks come from the meshable arena*/
+	unsigned int meshInterval;		/*the time(ms) between automatic mesh passes, 0 for on demand passes only*/
+	unsigned long sampleInterval;		/*the average bytes between sampled allocations, 0 disables tag accounting*/
+	unsigned int backgroundInterval;	/*the time(ms) between the background thread's passes, 0 disables the thread*/
+	unsigned int prefault;			/*the number of empty superblocks the background thread keeps prefaulted*/
+	size_t lockedBytes;			/*the bytes of superblocks reserved and locked at start, 0 disables the locked pool*/
+	unsigned int exhaustPolicy;		/*what an allocation does once the locked pool is used up(EXHAUST_FAIL, EXHAUST_GROW or EXHAUST_ABORT)*/
+} mtmmConfig;
+
+/*the virtual range every superblock comes from. Superblock number i owns the i-th SUPERBLOCK_SIZE bytes of the range and the i-th header*/
+typedef struct sSuperblockRegion
+{
+	char *base;				/*the start of the range*/
+	superblockHeader *headers;		/*the superblocks' headers, a separate mapping*/
+	unsigned long (*bitmaps)[BITMAP_WORDS];	/*the superblocks' free blocks(a set bit is a free block), a separate mapping*/
+	unsigned int numOfSlots;		/*the number of slots in the range*/
+	unsigned int openSlots;			/*the slots that were made accessible, the rest of the range is reserved only(updated atomically)*/
+	unsigned int nextSlot;			/*the first superblock slot that was never used*/
+	unsigned int numOfFreeSlots;		/*the number of slots in freeSlots*/
+	unsigned int freeSlots[REGION_SLOTS];	/*released slots that can be used again*/
+	pthread_mutex_t lock;			/*protects the slots and the mesh targets, always the innermost lock*/
+} superblockRegion;
+
+typedef struct sMeshArena
+{
+	int fd;					/*the memfd behind the superblocks region, -1 if meshing is disabled*/
+	unsigned int *targets;			/*the slot(+1) whose pages a slot is mapped onto, 0 if it has its own pages. Mapped with the arena*/
+	unsigned short *aliases;		/*the number of slots that are mapped onto a slot's pages. Mapped with the arena*/
+	pthread_mutex_t passLock;		/*serializes the mesh passes, the outermost lock but for the background pass lock*/
+	superblockHeader *meshing;		/*the superblock that is write protected for meshing, NULL if none*/
+	unsigned long lastPass;			/*the time(ms) of the last mesh pass*/
+	unsigned long meshedSuperblocks;	/*the number of superblocks whose pages were released*/
+	struct sigaction oldAction;		/*the SIGSEGV handler that was installed before ours*/
+	int forkFd;				/*the copy of the arena a forked child takes over, -1 if the copy failed*/
+} meshArena;
+
+typedef struct sEmptyPool
+{
+	superblockList warm;			/*empty superblocks that still have their pages, the most recently emptied first*/
+	superblockList cold;			/*empty superblocks whose pages were purged*/
+	pthread_mutex_t lock;			/*protects the pool, taken after the class locks*/
+	unsigned long reused;			/*the number of superblocks taken from the pool*/
+	unsigned int numOfWarm;			/*the number of superblocks in the warm list*/
+} emptyPool;
+
+/*the optional thread that does the housekeeping the hot paths would otherwise do inline(see background_pass)*/
+typedef struct sBackgroundThread
+{
+	int started;				/*whether the thread was created(set with CAS)*/
+	int running;				/*whether the thread runs, the hot paths leave purging and meshing to it(read atomically)*/
+	unsigned int requested;			/*set by a malloc that wants a pass before the interval is over, the thread sleeps on it*/
+	unsigned long passes;			/*the number of passes the thread made*/
+	pthread_mutex_t passLock;		/*held for the whole of a pass, and across a fork so the child's locks are free. Taken before the mesh pass lock*/
+} backgroundThread;
+
+typedef struct sMediumSpan
+{
+	struct sMediumSpan *next;		/*the next span*/
+	char *end;				/*the end of the span*/
+} mediumSpan;
+
+/*the header of a run of pages in a span. Runs are laid out back to back after the span's header page*/
+typedef struct sRunHeader
+{
+	unsigned long pages;			/*the number of pages in the run*/
+	unsigned long prevPages;		/*the number of pages in the run right before it, 0 if it's the first run of the span*/
+	int isFree;				/*is the run in a bin*/
+	struct sRunHeader *next;		/*the next free run in the bin, or the private heap's next block while it's used*/
+	struct sRunHeader *prev;		/*the previous free run in the bin, or the private heap's previous block while it's used*/
+	mediumSpan *span;			/*the run's span*/
+	struct sMtmmHeap *heap;			/*the private heap the block belongs to, NULL for malloc's blocks*/
+} __attribute__((aligned(16))) runHeader;
+
+/*the header of a block mapped directly from the OS*/
+typedef struct sLargeHeader
+{
+	size_t size;				/*the size of the mapping*/
+	size_t blockSize;			/*the size that was asked for*/
+	struct sMtmmHeap *heap;			/*the private heap the block belongs to, NULL for malloc's blocks*/
+	struct sLargeHeader *next;		/*the private heap's next large block*/
+	struct sLargeHeader *prev;		/*the private heap's previous large block*/
+} __attribute__((aligned(16))) largeHeader;
+
+/*an allocation that was sampled for the tags' accounting*/
+typedef struct sSampledBlock
+{
+	void *block;				/*the block, NULL if the slot is free(set with CAS)*/
+	unsigned int tag;			/*the tag that was current when the block was allocated*/
+	unsigned long weight;			/*the bytes the sample stands for*/
+} sampledBlock;
+
+/*a bump allocator over superblocks taken from the superblock supply(see mtmm_arena_begin)*/
+typedef struct sMtmmArena
+{
+	superblockList superblocks;		/*the superblocks the arena carves, the current one at the head*/
+	char *cursor;				/*the next free byte of the current superblock*/
+	char *end;				/*the end of the current superblock*/
+	struct sArenaBlock *blocks;		/*the arena's blocks that were too big for a superblock*/
+} mtmm_arena_t;
+
+/*a block of an arena that was allocated by malloc, the record itself is carved from the arena*/
+typedef struct sArenaBlock
+{
+	void *block;
+	struct sArenaBlock *next;
+} arenaBlock;
+
+/*a heap with its own size classes(see mtmm_heap_create). Its superblocks stay in it until they empty, its large blocks are listed so they can be freed with it*/
+typedef struct sMtmmHeap
+{
+	memHeap heap;				/*the size classes, first so a superblock's parentHeap leads back to the private heap*/
+	size_t limit;				/*the max bytes of superblocks and large blocks the heap may hold, 0 for no limit*/
+	size_t size;				/*the bytes of superblocks and large blocks the heap holds(updated atomically)*/
+	runHeader *runs;			/*the used runs of the heap's "large" blocks*/
+	largeHeader *largeBlocks;		/*the heap's blocks that were allocated directly from the OS*/
+	pthread_mutex_t lock;			/*protects runs and largeBlocks*/
+} mtmm_heap_t;
+
+/*the levels of the page map. Nodes are allocated when a page under them is first mapped, and never freed*/
+typedef struct sPageMapLeaf
+{
+	unsigned long entries[PAGE_MAP_FANOUT];	/*a kind(PAGE_SUPERBLOCK, PAGE_RUN or PAGE_LARGE) and a record for every page, 0 if the page isn't ours*/
+} pageMapLeaf;
+
+typedef struct sPageMapNode
+{
+	pageMapLeaf *leaves[PAGE_MAP_FANOUT];
+} pageMapNode;
+
+typedef struct sMediumHeap
+{
+	runHeader *bins[MEDIUM_BINS];		/*the free runs by number of pages. The last bin holds all the longer runs, sorted by length*/
+	unsigned long nonEmptyBins[MEDIUM_BINS/64];	/*a bit for every bin that has a run*/
+	mediumSpan *spans;			/*the reserved spans*/
+	unsigned int numOfSpans;		/*the number of spans*/
+	unsigned long dirtyPages;		/*an estimate of the pages of free runs that are still backed*/
+	pthread_mutex_t lock;			/*protects the runs and the spans*/
+} mediumHeap;
+
+typedef struct sThreadCache
+{
+	freeBlock *heads[NUM_OF_CLASSES];	/*the cached blocks of every class, linked through freeBlock.next*/
+	unsigned int counts[NUM_OF_CLASSES];	/*the number of cached blocks of every class*/
+} threadCache;
+
+/*retired blocks of one epoch. They are kept out of line since readers may still use the blocks' contents*/
+typedef struct sRetiredBatch
+{
+	struct sRetiredBatch *next;		/*the batch retired before this one in the same epoch*/
+	unsigned int count;			/*the number of blocks in the batch*/
+	void *blocks[RETIRE_BATCH];
+} retiredBatch;
+
+/*a thread's epoch announcement and its retired blocks. Records are never freed, a thread that exits leaves its record to the next new thread*/
+typedef struct sEpochRecord
+{
+	unsigned long epoch;			/*the global epoch the thread saw when it entered its critical section, 0 outside of it*/
+	unsigned int depth;			/*the nesting depth of mtmm_epoch_enter calls*/
+	int inUse;				/*whether a thread owns the record(set with CAS)*/
+	retiredBatch *limbo[LIMBO_LISTS];	/*the retired blocks by the epoch they were retired in*/
+	unsigned long limboEpoch[LIMBO_LISTS];	/*the epoch each limbo list was retired in*/
+	unsigned int pending;			/*the number of blocks retired since the last attempt to advance the epoch*/
+	struct sEpochRecord *next;		/*the next record in the list of all records*/
+} epochRecord;
+
+/*the tunables. They are written only by init(), so the hot paths can treat them as constants*/
+static mtmmConfig config = {F, TARGET_FRACTION, RESERVE, K, NUM_OF_CPUS, MAX_HEAPS, NUM_OF_POOLS, SIZE_THRESHOLD, TCACHE_SIZE, PURGE_DECAY, MESH, MESH_INTERVAL, SAMPLE_INTERVAL, BACKGROUND, PREFAULT, LOCKED, EXHAUSTED};
+static superblockRegion sbRegion = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static meshArena meshSpace = {.fd = -1, .passLock = PTHREAD_MUTEX_INITIALIZER};
+static emptyPool emptySuperblocks = {.lock = PTHREAD_MUTEX_INITIALIZER};	/*empty superblocks of any class*/
+static backgroundThread background = {.passLock = PTHREAD_MUTEX_INITIALIZER};	/*the housekeeping thread, if the background tunable enables it*/
+static unsigned int lockedSlots;		/*the superblock slots of the locked pool, the first ones of the region*/
+static unsigned long lockedExhaustions;		/*the allocations that found the locked pool used up(updated atomically)*/
+static pageMapNode *pageMap[PAGE_MAP_FANOUT];	/*the root of the page map*/
+static mediumHeap mediumBlocks = {.lock = PTHREAD_MUTEX_INITIALIZER};	/*the page runs of the "large" blocks*/
+static unsigned int nextColor;			/*the color of the next superblock that's formatted(updated atomically)*/
+static __thread threadCache tcache;		/*blocks freed by this thread or taken in a batch, kept for its next mallocs*/
+static __thread unsigned int randomState;	/*the state of the thread's xorshift generator*/
+static __thread unsigned int currentTag;	/*the tag the thread's allocations are accounted to(see mtmm_set_tag)*/
+static __thread long bytesUntilSample;		/*the bytes the thread allocates before its next sampled allocation*/
+static __thread long sampleDistance;		/*the distance bytesUntilSample was last drawn as, 0 until it's drawn*/
+static sampledBlock sampledBlocks[SAMPLE_SLOTS];	/*the sampled allocations that weren't freed yet*/
+static unsigned long droppedSamples;		/*the sampled allocations the table had no room for(updated atomically)*/
+static long tagBytes[MAX_OF_CPUS][MTMM_MAX_TAGS];	/*the estimated bytes of every tag, by the CPU heap of the thread that allocated or freed them(updated atomically)*/
+static unsigned long globalEpoch = 1;		/*the reclamation epoch(updated atomically), starts at 1 since 0 marks a thread outside a critical section*/
+static epochRecord sharedEpoch = {.inUse = 1};	/*the record of the threads a record couldn't be allocated for, they take sharedEpochLock to use it*/
+static pthread_mutex_t sharedEpochLock = PTHREAD_MUTEX_INITIALIZER;
+static epochRecord *epochRecords = &sharedEpoch;	/*all the threads' records, pushed atomically*/
+static __thread epochRecord *threadEpoch;	/*the thread's record, NULL until it first uses the epoch API*/
+static pthread_key_t epochKey;			/*gives the thread's record back when the thread exits*/
+static __thread memHeap *boundHeap;		/*the heap the thread was bound to, NULL to choose it by hashing the thread*/
+static __thread int threadRegistered;		/*whether the thread's exit destructor(thread_exit) is registered*/
+static pthread_key_t threadKey;			/*runs thread_exit when the thread exits*/
+static __thread memHeap *hoppedHeap;		/*the heap the thread moved to when its heap was busy, NULL if it didn't*/
+static unsigned long dedicatedHeaps;		/*a bit for every CPU heap past the configured ones that a thread owns(updated with CAS)*/
+static pthread_key_t heapKey;			/*unbinds the thread from its heap when it exits, giving a dedicated heap back*/
+static unsigned int activeHeaps = NUM_OF_CPUS;	/*the number of CPU heaps threads are hashed over(grows atomically, see note_contention)*/
+static unsigned int contendedLocks;		/*the busy heap locks since contentionWindow(updated atomically)*/
+static unsigned long contentionWindow;		/*the time(ms) the busy heap locks are counted from*/
+static unsigned int lockSpins;			/*the times a class lock is polled before sleeping, 0 on a single CPU*/
+static int isInitialized = 0;			/*whether the data structure has been initialized(read atomically)*/
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;	/*guards init() against concurrent first mallocs*/
+/*1 heap per CPU, and the global heap split into independently locked shards("pools").
+The locks are initialized statically, so a heap is usable even before init() has run*/
+static memHeap heaps[MAX_OF_CPUS] = {
+	[0 ... MAX_OF_CPUS-1] = {
+		.classes = {
+			[0 ... NUM_OF_CLASSES-1] = { .lock = LOCK_INITIALIZER }
+		}
+	}
+};
+static memHeap globalPools[MAX_OF_POOLS] = {
+	[0 ... MAX_OF_POOLS-1] = {
+		.classes = {
+			[0 ... NUM_OF_CLASSES-1] = { .lock = LOCK_INITIALIZER }
+		}
+	}
+};
+
+/*whether a parsed value is a whole number an integer tunable of at most max can hold*/
+static inline int config_integer(double num, double max)
+{
+	return num == floor(num) && num < max + 1;
+}
+
+/*parse a "key:value,key:value" string into the configuration. Bad entries(negative, or not an integer where one is expected, or out of range) are reported and ignored*/
+static void parse_config(const char *conf)
+{
+	while(*conf != '\0')
+	{
+		const char *key = conf;
+		size_t keyLen = strcspn(key, ":,");
+		const char *value = key + keyLen;
+		char *end = (char *)value;
+		double num = -1;
+		if(*value == ':')
+			num = strtod(value + 1, &end);
+		if(end == value || !(num >= 0) || (*end != ',' && *end != '\0'))	/*NaN fails the comparison too*/
+			fprintf(stderr, "mtmm: bad MTMM_CONF entry \"%.*s\"\n", (int)strcspn(key, ","), key);
+		else if(keyLen == 1 && key[0] == 'f' && num < 1)
+			config.emptyFraction = num;
+		else if(keyLen == 6 && !strncmp(key, "target", 6) && num < 1)
+			config.targetFraction = num;
+		else if(keyLen == 7 && !strncmp(key, "reserve", 7) && config_integer(num, UINT_MAX))
+			config.reserve = num;
+		else if(keyLen == 1 && key[0] == 'k' && config_integer(num, UINT_MAX))
+			config.minSuperblocks = num;
+		else if(keyLen == 5 && !strncmp(key, "heaps", 5) && config_integer(num, MAX_OF_CPUS) && num >= 1 && num <= MAX_OF_CPUS)
+			config.numOfCpus = num;
+		else if(keyLen == 9 && !strncmp(key, "max_heaps", 9) && config_integer(num, MAX_OF_CPUS) && num >= 1 && num <= MAX_OF_CPUS)
+			config.maxHeaps = num;
+		else if(keyLen == 5 && !strncmp(key, "pools", 5) && config_integer(num, MAX_OF_POOLS) && num >= 1 && num <= MAX_OF_POOLS)
+			config.numOfPools = num;
+		else if(keyLen == 9 && !strncmp(key, "threshold", 9) && config_integer(num, SUPERBLOCK_SIZE/2) && num >= 1 && num <= SUPERBLOCK_SIZE/2)
+			config.sizeThreshold = num;
+		else if(keyLen == 6 && !strncmp(key, "tcache", 6) && config_integer(num, UINT_MAX))
+			config.tcacheSize = num;
+		else if(keyLen == 5 && !strncmp(key, "decay", 5) && config_integer(num, UINT_MAX))
+			config.purgeDecay = num;
+		else if(keyLen == 4 && !strncmp(key, "mesh", 4) && config_integer(num, 1))
+			config.mesh = num;
+		else if(keyLen == 13 && !strncmp(key, "mesh_interval", 13) && config_integer(num, UINT_MAX))
+			config.meshInterval = num;
+		else if(keyLen == 6 && !strncmp(key, "sample", 6) && config_integer(num, ULONG_MAX))
+			config.sampleInterval = num;
+		else if(keyLen == 10 && !strncmp(key, "background", 10) && config_integer(num, UINT_MAX))
+			config.backgroundInterval = num;
+		else if(keyLen == 8 && !strncmp(key, "prefault", 8) && config_integer(num, UINT_MAX))
+			config.prefault = num;
+		else if(keyLen == 6 && !strncmp(key, "locked", 6) && config_integer(num, SIZE_MAX))
+			config.lockedBytes = num;
+		else if(keyLen == 9 && !strncmp(key, "exhausted", 9) && config_integer(num, EXHAUST_ABORT))
+			config.exhaustPolicy = num;
+		else
+			fprintf(stderr, "mtmm: bad MTMM_CONF entry \"%.*s\"\n", (int)strcspn(key, ","), key);
+		conf = key + strcspn(key, ",");
+		if(*conf == ',')
+			conf++;
+	}
+}
+
+/*a write to a superblock that is being meshed faults, wait until the superblock is remapped and retry the write*/
+static void mesh_fault_handler(int sig, siginfo_t *info, void *context)
+{
+	if(IN_REGION(info->si_addr))
+	{
+		while(__atomic_load_n(&(meshSpace.meshing), __ATOMIC_ACQUIRE) != NULL)
+			sched_yield();
+		return;
+	}
+	/*not ours, hand the fault over to the previous handler*/
+	if(meshSpace.oldAction.sa_flags & SA_SIGINFO)
+		meshSpace.oldAction.sa_sigaction(sig, info, context);
+	else if(meshSpace.oldAction.sa_handler == SIG_DFL || meshSpace.oldAction.sa_handler == SIG_IGN)
+		signal(sig, SIG_DFL); /*the faulting instruction runs again and kills the process*/
+	else
+		meshSpace.oldAction.sa_handler(sig);
+}
+
+/*reserve a range of size bytes as a meshable arena: a sparse memfd mapped shared, so a range of it can be remapped onto another range's pages.
+The arena's slot tables are mapped with it. Returns NULL if it can't be reserved, meshing stays disabled then*/
+static void * reserve_mesh_range(unsigned long size)
+{
+	unsigned long slots = size / SUPERBLOCK_SIZE;
+	int fd = memfd_create("mtmm", MFD_CLOEXEC);
+	void *base = MAP_FAILED, *tables = MAP_FAILED;
+	if(fd != -1 && ftruncate(fd, size) == 0)
+		base = mmap(NULL, size, PROT_NONE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+	if(base != MAP_FAILED)
+		tables = mmap(NULL, slots*(sizeof(unsigned int) + sizeof(unsigned short)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(tables == MAP_FAILED)
+	{
+		if(base != MAP_FAILED)
+			munmap(base, size);
+		if(fd != -1)
+			close(fd);
+		return NULL;
+	}
+	meshSpace.fd = fd;
+	meshSpace.targets = tables;
+	meshSpace.aliases = (unsigned short *)(meshSpace.targets + slots);
+	return base;
+}
+
+/*install the fault handler of meshing(see mesh_fault_handler)*/
+static void init_mesh()
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = mesh_fault_handler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&(action.sa_mask));
+	sigaction(SIGSEGV, &action, &(meshSpace.oldAction));
+}
+
+/*reserve the superblocks region and the array of their headers. Neither is backed by memory until it's touched*/
+static void init_region()
+{
+	unsigned long size;
+	/*The range and its headers and bitmaps are only reserved, slots are made accessible as they're used, so nothing is committed
+	under strict overcommit. A smaller range is tried if the address space is limited(RLIMIT_AS)*/
+	for(size = REGION_SIZE; size >= MIN_REGION_SIZE; size /= 2)
+	{
+		unsigned long slots = size / SUPERBLOCK_SIZE;
+		void *base = config.mesh ? reserve_mesh_range(size) : NULL;
+		if(base == NULL)
+		{
+			base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			base = (base == MAP_FAILED) ? NULL : base;
+		}
+		void *headers = mmap(NULL, slots*sizeof(superblockHeader), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		void *bitmaps = mmap(NULL, slots*BITMAP_WORDS*sizeof(unsigned long), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(base != NULL && headers != MAP_FAILED && bitmaps != MAP_FAILED)
+		{
+			sbRegion.base = base;
+			sbRegion.headers = headers;
+			sbRegion.bitmaps = bitmaps;
+			sbRegion.numOfSlots = slots;
+			break;
+		}
+		if(base != NULL)
+			munmap(base, size);
+		if(headers != MAP_FAILED)
+			munmap(headers, slots*sizeof(superblockHeader));
+		if(bitmaps != MAP_FAILED)
+			munmap(bitmaps, slots*BITMAP_WORDS*sizeof(unsigned long));
+		if(meshSpace.fd != -1)
+		{
+			close(meshSpace.fd);
+			meshSpace.fd = -1;
+			munmap(meshSpace.targets, slots*(sizeof(unsigned int) + sizeof(unsigned short)));
+		}
+	}
+	if(sbRegion.base == NULL)
+		INIT_EXIT("mtmm: can't reserve the superblocks region\n")
+	if(config.mesh && !MESHING_ENABLED)
+		fprintf(stderr, "mtmm: can't create the mesh arena, meshing is disabled\n");
+	if(MESHING_ENABLED)
+		init_mesh();
+}
+
+/*make the next REGION_CHUNK slots of the region accessible, with their headers and bitmaps. The region must be locked.
+Returns -1 if the OS refuses to commit them*/
+static int open_slots()
+{
+	unsigned int first = sbRegion.openSlots;
+	unsigned int n = sbRegion.numOfSlots - first < REGION_CHUNK ? sbRegion.numOfSlots - first : REGION_CHUNK;
+	if(mprotect(SLOT_DATA(first), (unsigned long)n * SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE)
+		|| mprotect(&(sbRegion.headers[first]), n*sizeof(superblockHeader), PROT_READ | PROT_WRITE)
+		|| mprotect(sbRegion.bitmaps[first], n*sizeof(*sbRegion.bitmaps), PROT_READ | PROT_WRITE))
+		return -1;
+	__atomic_store_n(&(sbRegion.openSlots), first + n, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*copy the arena's pages into a new memfd, or return -1*/
+static int copy_arena()
+{
+	unsigned int s;
+	int fd = memfd_create("mtmm", MFD_CLOEXEC);
+	if(fd == -1 || ftruncate(fd, (off_t)sbRegion.numOfSlots * SUPERBLOCK_SIZE))
+	{
+		if(fd != -1)
+			close(fd);
+		return -1;
+	}
+	for(s=0; s<sbRegion.nextSlot; s++)
+	{
+		off_t start = (off_t)s * SUPERBLOCK_SIZE;
+		off_t data = lseek(meshSpace.fd, start, SEEK_DATA);
+		/*aliases are remapped by the child, and slots with no pages(released ones) have nothing to copy*/
+		if(meshSpace.targets[s] != 0 || data < 0 || data >= start + SUPERBLOCK_SIZE)
+			continue;
+		if(pwrite(fd, SLOT_DATA(s), SUPERBLOCK_SIZE, start) != SUPERBLOCK_SIZE)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/*a forked child would share the arena's pages with its parent, so it gets a copy of them.
+The copy is made before the fork, the parent may change the shared pages as soon as the fork returns*/
+static void mesh_atfork_prepare()
+{
+	pthread_mutex_lock(&(meshSpace.passLock));
+	pthread_mutex_lock(&(sbRegion.lock));
+	meshSpace.forkFd = copy_arena();
+}
+
+static void mesh_atfork_parent()
+{
+	if(meshSpace.forkFd != -1)
+		close(meshSpace.forkFd);
+	pthread_mutex_unlock(&(sbRegion.lock));
+	pthread_mutex_unlock(&(meshSpace.passLock));
+}
+
+static void mesh_atfork_child()
+{
+	unsigned int s;
+	int fd = meshSpace.forkFd;
+	if(fd == -1)
+		INIT_EXIT("mtmm: can't copy the mesh arena\n")
+	if(mmap(sbRegion.base, (unsigned long)sbRegion.numOfSlots * SUPERBLOCK_SIZE, PROT_NONE, MAP_SHARED | MAP_NORESERVE | MAP_FIXED, fd, 0) == MAP_FAILED
+		|| mprotect(sbRegion.base, (unsigned long)sbRegion.openSlots * SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE))
+		INIT_EXIT("mtmm: can't copy the mesh arena\n")
+	for(s=0; s<sbRegion.nextSlot; s++)
+	{
+		if(meshSpace.targets[s] != 0 && mmap(SLOT_DATA(s), SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t)(meshSpace.targets[s] - 1) * SUPERBLOCK_SIZE) == MAP_FAILED)
+			INIT_EXIT("mtmm: can't copy the mesh arena\n")
+	}
+	close(meshSpace.fd);
+	meshSpace.fd = fd;
+	pthread_mutex_unlock(&(sbRegion.lock));
+	pthread_mutex_unlock(&(meshSpace.passLock));
+}
+
+static void release_epoch_record(void *record);
+static void release_bound_heap(void *heap);
+static void thread_exit(void *unused);
+static void start_background();
+static void settle_superblock(superblockHeader *sb);
+static void background_atfork_prepare();
+static void background_atfork_parent();
+static void background_atfork_child();
+static void init_locked_pool();
+
+/*Take a class lock, spinning briefly before sleeping.
+While the process has a single thread the lock is taken with plain loads and stores. A second thread is only created outside
+of the allocator, or by it before any lock is taken(the background thread), so no lock is held when the process switches to atomics.
+A lock found taken(by a thread that didn't survive a fork) still blocks as it did*/
+static void lock_acquire(classLock *lock)
+{
+	unsigned int i, state = 0;
+	if(SINGLE_THREADED() && lock->state == 0)
+	{
+		lock->state = 1;
+		return;
+	}
+	if(__atomic_compare_exchange_n(&(lock->state), &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	for(i=0; i<lockSpins; i++)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+		state = 0;
+		if(__atomic_load_n(&(lock->state), __ATOMIC_RELAXED) == 0 && __atomic_compare_exchange_n(&(lock->state), &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	}
+	/*mark the lock as contended, whoever releases it wakes a sleeper*/
+	while(__atomic_exchange_n(&(lock->state), 2, __ATOMIC_ACQUIRE) != 0)
+		syscall(SYS_futex, &(lock->state), FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
+
+/*returns 0 if the lock was taken, like pthread_mutex_trylock*/
+static inline int lock_try(classLock *lock)
+{
+	unsigned int state = 0;
+	if(SINGLE_THREADED() && lock->state == 0)
+	{
+		lock->state = 1;
+		return 0;
+	}
+	return !__atomic_compare_exchange_n(&(lock->state), &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void lock_release(classLock *lock)
+{
+	if(SINGLE_THREADED() && lock->state == 1)
+	{
+		lock->state = 0;
+		return;
+	}
+	if(__atomic_exchange_n(&(lock->state), 0, __ATOMIC_RELEASE) == 2)
+		syscall(SYS_futex, &(lock->state), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
-/*initialize the data structure(runs only on the first malloc)*/
+/*initialize the data structure(runs exactly once, through pthread_once)*/
 static void init()
 {
 	int i, j;
-	for(i=0; i<NUM_OF_HEAPS; i++)
+	const char *conf = getenv("MTMM_CONF");
+	if(conf != NULL)
+		parse_config(conf);
+	if(config.targetFraction < 0)
+		config.targetFraction = config.emptyFraction/2;
+	if(config.targetFraction > config.emptyFraction)
+		config.targetFraction = config.emptyFraction;
+	if(config.maxHeaps < config.numOfCpus)
+		config.maxHeaps = config.numOfCpus;
+	/*meshing remaps superblocks and punches their pages out, which a locked pool can't allow*/
+	if(config.lockedBytes != 0 && config.mesh)
+	{
+		fprintf(stderr, "mtmm: mesh is ignored with a locked pool\n");
+		config.mesh = 0;
+	}
+	activeHeaps = config.numOfCpus;
+	init_region();
+	lockSpins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? LOCK_SPINS : 0;
+	/*the destructors run in this order: retired blocks are freed, then the cache is flushed, then a dedicated heap is given back*/
+	if(pthread_key_create(&epochKey, release_epoch_record) || pthread_key_create(&threadKey, thread_exit) || pthread_key_create(&heapKey, release_bound_heap))
+		INIT_EXIT("mtmm: can't create the thread keys\n")
+	for(i=0; i<MAX_OF_CPUS; i++)
 	{
 		heaps[i].id = i;
 		for(j=0; j<NUM_OF_CLASSES; j++)
-		{
 			heaps[i].classes[j].size = SIZE_OF_CLASS(j);
-			heaps[i].classes[j].usedBlocks = 0;
-			heaps[i].classes[j].numOfBlocks = 0;
-			if(pthread_mutex_init(&heaps[i].classes[j].lock, NULL))
-				EXIT("Mutex init failed")
-		}
 	}
+	for(i=0; i<MAX_OF_POOLS; i++)
+	{
+		globalPools[i].id = i;
+		for(j=0; j<NUM_OF_CLASSES; j++)
+			globalPools[i].classes[j].size = SIZE_OF_CLASS(j);
+	}
+	if(config.lockedBytes != 0)
+		init_locked_pool();
+	__atomic_store_n(&isInitialized, 1, __ATOMIC_RELEASE);
+}
+
+/*make sure the data structure is initialized. After the first call this is a single atomic load*/
+static inline void ensure_init()
+{
+	if(!__atomic_load_n(&isInitialized, __ATOMIC_ACQUIRE))
+		pthread_once(&initOnce, init);
+}
+
+/*initialize when the library is loaded, so the first malloc usually doesn't pay for it*/
+__attribute__((constructor)) static void init_on_load()
+{
+	ensure_init();
+	/*pthread_atfork may allocate, so it can't be called from init()*/
+	if(MESHING_ENABLED)
+		pthread_atfork(mesh_atfork_prepare, mesh_atfork_parent, mesh_atfork_child);
+	if(config.backgroundInterval != 0)
+		pthread_atfork(background_atfork_prepare, background_atfork_parent, background_atfork_child);
+}
+
+/*the current time in milliseconds(coarse, it's only used for intervals)*/
+static unsigned long now_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec*1000 + now.tv_nsec/1000000;
 }
 
 /*request memory from OS*/
@@ -119,21 +813,222 @@ static void * fetch_memory(size_t sz)
 	return p;
 }
 
-/*Search the superblocks of a size class for a free block.
-Returns NULL if not found*/
-static blockHeader * search_sizeclass(sizeClass *class)
+/*the page map entry of an address, 0 if the allocator doesn't own its page. Safe without any lock*/
+static unsigned long page_lookup(const void *p)
+{
+	unsigned long page = (unsigned long)p >> PAGE_SHIFT;
+	if(page >> (3*PAGE_MAP_BITS))
+		return 0;
+	pageMapNode *node = __atomic_load_n(&(pageMap[page >> (2*PAGE_MAP_BITS)]), __ATOMIC_ACQUIRE);
+	if(node == NULL)
+		return 0;
+	pageMapLeaf *leaf = __atomic_load_n(&(node->leaves[(page >> PAGE_MAP_BITS) & (PAGE_MAP_FANOUT-1)]), __ATOMIC_ACQUIRE);
+	if(leaf == NULL)
+		return 0;
+	return __atomic_load_n(&(leaf->entries[page & (PAGE_MAP_FANOUT-1)]), __ATOMIC_ACQUIRE);
+}
+
+/*get a page map level, allocating it if it's missing. Another thread may install it first, then its node is used*/
+static void * page_map_level(void **slot, size_t size)
+{
+	void *level = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if(level == NULL)
+	{
+		void *fresh = fetch_memory(size);
+		if(fresh == NULL)
+			return NULL;
+		/*the levels of the locked pool's pages are made at start, and locked with it*/
+		if(config.lockedBytes != 0 && mlock(fresh, size))
+			perror(NULL);
+		if(__atomic_compare_exchange_n(slot, &level, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			level = fresh;
+		else
+			munmap(fresh, size);
+	}
+	return level;
+}
+
+/*set the page map entries of the pages in [start, start+len). Returns -1 if a level of the map can't be allocated*/
+static int page_map_set(const void *start, size_t len, unsigned long entry)
+{
+	unsigned long page, last = ((unsigned long)start + len - 1) >> PAGE_SHIFT;
+	for(page = (unsigned long)start >> PAGE_SHIFT; page <= last; page++)
+	{
+		pageMapNode *node = page_map_level((void **)&(pageMap[page >> (2*PAGE_MAP_BITS)]), sizeof(pageMapNode));
+		pageMapLeaf *leaf = node ? page_map_level((void **)&(node->leaves[(page >> PAGE_MAP_BITS) & (PAGE_MAP_FANOUT-1)]), sizeof(pageMapLeaf)) : NULL;
+		if(leaf == NULL)
+			return -1;
+		__atomic_store_n(&(leaf->entries[page & (PAGE_MAP_FANOUT-1)]), entry, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*An allocation needs memory from the OS while the locked pool is on, so the pool is used up. The allocation is counted, and is
+allowed if the policy is EXHAUST_GROW. Otherwise errno is set to ENOMEM and 0 is returned, or the process aborts(EXHAUST_ABORT)*/
+static int locked_pool_exhausted()
+{
+	__atomic_add_fetch(&lockedExhaustions, 1, __ATOMIC_RELAXED);
+	if(config.exhaustPolicy == EXHAUST_ABORT)
+	{
+		fprintf(stderr, "mtmm: the locked pool is exhausted\n");
+		abort();
+	}
+	if(config.exhaustPolicy == EXHAUST_GROW)
+		return 1;
+	errno = ENOMEM;
+	return 0;
+}
+
+/*take an unused superblock slot of the region. Returns its header, or NULL if the region is used up.
+With the locked pool on, every slot of the pool is in the empty superblocks pool or in use, so a new slot means the pool is used up*/
+static superblockHeader * fetch_superblock()
 {
-	if(class->usedBlocks == class->numOfBlocks) /*no available blocks*/
+	superblockHeader *sb = NULL;
+	if(config.lockedBytes != 0 && !locked_pool_exhausted())
 		return NULL;
-	superblockHeader *p = (class->superblocks).head;
-	while(p != NULL)
+	pthread_mutex_lock(&(sbRegion.lock));
+	if(sbRegion.numOfFreeSlots > 0)
+		sb = &(sbRegion.headers[sbRegion.freeSlots[--sbRegion.numOfFreeSlots]]);
+	else if(sbRegion.nextSlot < sbRegion.numOfSlots && (sbRegion.nextSlot < sbRegion.openSlots || open_slots() == 0))
+		sb = &(sbRegion.headers[sbRegion.nextSlot++]);
+	pthread_mutex_unlock(&(sbRegion.lock));
+	return sb;
+}
+
+/*take n blocks off a superblock's used count and return the new state.
+If the superblock was meshed while the blocks were looked up, they're taken off the superblock it was meshed into, and *sbp is updated*/
+static inline unsigned int uncount_blocks(superblockHeader **sbp, unsigned int n)
+{
+	superblockHeader *sb = *sbp;
+	unsigned int state = __atomic_load_n(&(sb->state), __ATOMIC_ACQUIRE);
+	do
 	{
-		if(p->usedBlocks < p->numOfBlocks) /*there's a free block*/
-			return (p->freeList).head; /*the first free block*/
-		p = p->next;
+		/*the superblock is being meshed, once it's done the superblock points to the one it was merged into*/
+		while(state & STATE_FROZEN)
+		{
+			superblockHeader *into = __atomic_load_n(&(sb->meshedInto), __ATOMIC_ACQUIRE);
+			if(into != NULL)
+				*sbp = sb = into;
+			else
+				sched_yield();
+			state = __atomic_load_n(&(sb->state), __ATOMIC_ACQUIRE);
+		}
+	} while(!__atomic_compare_exchange_n(&(sb->state), &state, state - n, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	return state - n;
+}
+
+/*mark a block free in its superblock and return the number of blocks still used. Safe without any lock.
+The count is updated first and the bitmap right after it, so for a moment a superblock may count more free blocks than its bitmap shows(see settle_superblock).
+If the superblock was meshed while the block was looked up, the block is freed to the superblock it was meshed into, and *sbp is updated*/
+static unsigned int free_block(superblockHeader **sbp, void *block)
+{
+	unsigned int state = uncount_blocks(sbp, 1);
+	unsigned int index = BLOCK_INDEX(*sbp, block, SIZE_OF_CLASS((*sbp)->class));
+	__atomic_fetch_or(&(BITMAP_OF(*sbp)[index/64]), 1UL << (index%64), __ATOMIC_RELEASE);
+	return STATE_USED(state);
+}
+
+/*free_block for up to RETIRE_BATCH blocks of one superblock: the used count is updated once, and each bitmap word the blocks share is ORed once*/
+static unsigned int free_blocks(superblockHeader **sbp, void **blocks, unsigned int n)
+{
+	unsigned int i, j, indexes[RETIRE_BATCH];
+	unsigned int state = uncount_blocks(sbp, n);
+	superblockHeader *sb = *sbp;
+	for(i=0; i<n; i++)
+		indexes[i] = BLOCK_INDEX(sb, blocks[i], SIZE_OF_CLASS(sb->class));
+	for(i=0; i<n; i++)
+	{
+		if(indexes[i] == ~0U) /*its word was already ORed*/
+			continue;
+		unsigned long bits = 1UL << (indexes[i]%64);
+		for(j=i+1; j<n; j++)
+		{
+			if(indexes[j] != ~0U && indexes[j]/64 == indexes[i]/64)
+			{
+				bits |= 1UL << (indexes[j]%64);
+				indexes[j] = ~0U;
+			}
+		}
+		__atomic_fetch_or(&(BITMAP_OF(sb)[indexes[i]/64]), bits, __ATOMIC_RELEASE);
+	}
+	return STATE_USED(state);
+}
+
+/*the index of the first non zero word of a bitmap, or -1 if all are 0. Two words are checked at a time with SSE2*/
+static int first_set_word(unsigned long *bitmap, unsigned int words)
+{
+	unsigned int w = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	for(; w + 2 <= words; w += 2)
+	{
+		__m128i pair = _mm_loadu_si128((const __m128i *)(bitmap + w));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(pair, zero)) != 0xFFFF)
+			break;
+	}
+#endif
+	for(; w < words; w++)
+	{
+		if(__atomic_load_n(&(bitmap[w]), __ATOMIC_RELAXED) != 0)
+			return w;
+	}
+	return -1;
+}
+
+static unsigned int next_random();
+
+/*take the free block with the lowest address from a superblock, or return NULL if it has none.
+Frees may set bits concurrently, but only the holder of the owning class' lock clears them.
+Meshing only finds superblocks whose live blocks don't overlap if blocks are handed out in a random order, so then the scan starts at a random word*/
+static freeBlock * pop_block(superblockHeader *sb)
+{
+	unsigned long *bitmap = BITMAP_OF(sb);
+	unsigned int words = (sb->numOfBlocks + 63) / 64, start = 0;
+	int w = -1;
+	if(MESHING_ENABLED)
+	{
+		start = next_random() % words;
+		w = first_set_word(bitmap + start, words - start);
+		if(w != -1)
+			w += start;
+	}
+	if(w == -1)
+		w = first_set_word(bitmap, words);
+	if(w == -1)
+		return NULL;
+	unsigned int bit = __builtin_ctzl(__atomic_load_n(&(bitmap[w]), __ATOMIC_ACQUIRE));
+	__atomic_fetch_and(&(bitmap[w]), ~(1UL << bit), __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&(sb->state), 1, __ATOMIC_RELAXED);
+	return BLOCK_AT(sb, w*64 + bit, SIZE_OF_CLASS(sb->class));
+}
+
+/*move the lowest free blocks of a superblock into the thread's cache, up to its size, a bitmap word at a time. The owning class must be locked*/
+static void fill_tcache(sizeClass *sc, superblockHeader *sb)
+{
+	unsigned long *bitmap = BITMAP_OF(sb);
+	unsigned int w, words = (sb->numOfBlocks + 63) / 64, class = sb->class;
+	for(w=0; w<words && tcache.counts[class] < config.tcacheSize; w++)
+	{
+		unsigned long take = __atomic_load_n(&(bitmap[w]), __ATOMIC_ACQUIRE);
+		while(take != 0 && __builtin_popcountl(take) > config.tcacheSize - tcache.counts[class])
+			take &= ~(1UL << (63 - __builtin_clzl(take))); /*keep the lowest ones*/
+		if(take == 0)
+			continue;
+		unsigned int n = __builtin_popcountl(take);
+		__atomic_fetch_and(&(bitmap[w]), ~take, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&(sb->state), n, __ATOMIC_RELAXED);
+		sb->countedBlocks += n;
+		sc->usedBlocks += n;
+		/*push the highest first, so the cache hands out the lowest first*/
+		while(take != 0)
+		{
+			freeBlock *block = BLOCK_AT(sb, w*64 + 63 - __builtin_clzl(take), SIZE_OF_CLASS(class));
+			take &= ~(1UL << (63 - __builtin_clzl(take)));
+			block->next = tcache.heads[class];
+			tcache.heads[class] = block;
+			tcache.counts[class]++;
+		}
 	}
-	return NULL; /*this shouldn't be reached, because we move past the first if(line 116) iff there's a free block.
-			the first if isn't necessary but it avoids unnecessary scans*/
 }
 
 /*swap sb with the next superblock in a size class' list*/
@@ -159,22 +1054,97 @@ static void swap_superblocks(superblockList *list, superblockHeader *sb)
 	}
 }
 
-/*move a superblock from one heap to another*/
+/*fold the frees done to a superblock since its last reconciliation into its class' counters. The class must be locked*/
+static void reconcile_superblock(sizeClass *sc, superblockHeader *sb)
+{
+	int delta = (int)STATE_USED(__atomic_load_n(&(sb->state), __ATOMIC_ACQUIRE)) - (int)sb->countedBlocks;
+	sc->usedBlocks += delta;
+	sb->countedBlocks += delta;
+}
+
+/*reconcile every superblock of a class and restore the list's order by fullness. The class must be locked*/
+static void reconcile_sizeclass(sizeClass *sc)
+{
+	superblockHeader *sb = sc->superblocks.head;
+	__atomic_store_n(&(sc->pendingFrees), 0, __ATOMIC_RELAXED);
+	while(sb != NULL)
+	{
+		superblockHeader *next = sb->next;
+		reconcile_superblock(sc, sb);
+		/*insertion sort, the part of the list before sb is already sorted*/
+		while(sb->prev != NULL && sb->countedBlocks > (sb->prev)->countedBlocks)
+		{
+			swap_superblocks(&(sc->superblocks), sb->prev);
+		}
+		sb = next;
+	}
+}
+
+/*Search the superblocks of a size class for one with a free block.
+Returns NULL if not found. The class must be locked*/
+static superblockHeader * search_sizeclass(sizeClass *class)
+{
+	if(class->usedBlocks >= class->numOfBlocks) /*no available blocks, unless there were frees since the last reconciliation*/
+	{
+		if(__atomic_load_n(&(class->pendingFrees), __ATOMIC_RELAXED) == 0)
+			return NULL;
+		reconcile_sizeclass(class);
+		if(class->usedBlocks >= class->numOfBlocks)
+			return NULL;
+	}
+	superblockHeader *p = (class->superblocks).head;
+	while(p != NULL)
+	{
+		if(STATE_USED(__atomic_load_n(&(p->state), __ATOMIC_ACQUIRE)) < p->numOfBlocks) /*there's a free block*/
+			return p;
+		p = p->next;
+	}
+	return NULL;
+}
+
+/*take a free block from a superblock of a class and update the statistics. The class must be locked*/
+static freeBlock * take_block(sizeClass *sc, superblockHeader *superblock)
+{
+	freeBlock *block = pop_block(superblock);
+	if(block == NULL)
+		return NULL;
+	/*update the superblock's and size class' statistics*/
+	superblock->countedBlocks++;
+	sc->usedBlocks++;
+	/*the thread's next mallocs of this class are served from its cache. Meshing needs every block placed randomly, so it's filled one block at a time by frees only*/
+	if(config.tcacheSize > 0 && !MESHING_ENABLED && !IS_PRIVATE(superblock->parentHeap))
+		fill_tcache(sc, superblock);
+	/*move the superblock to it's new correct position in the size class*/
+	while(superblock->prev!=NULL && superblock->countedBlocks > (superblock->prev)->countedBlocks)
+	{
+		swap_superblocks(&(sc->superblocks),superblock->prev);
+	}
+	return block;
+}
+
+/*remove a superblock from a size class' list*/
+static void unlink_superblock(superblockList *list, superblockHeader *sb)
+{
+	if(list->head == sb)
+		list->head = sb->next;
+	if(list->tail == sb)
+		list ->tail = sb->prev;
+	if(sb->next != NULL)
+		(sb->next)->prev = sb->prev;
+	if(sb->prev != NULL)
+		(sb->prev)->next = sb->next;
+}
+
+/*move a superblock from one heap to another. Both classes must be locked*/
 static void move_superblock(superblockHeader *sb, memHeap *src, memHeap *dst, int class)
 {
 	sizeClass *src_class = &(src->classes[class]);
 	sizeClass *dst_class = &(dst->classes[class]);
 	superblockList *src_list = &(src_class->superblocks);
 	superblockList *dst_list = &(dst_class->superblocks);
+	reconcile_superblock(src_class, sb);
 	/*remove superblock from the original list*/
-	if(src_list->head == sb)
-		src_list->head = sb->next;
-	if(src_list->tail == sb)
-		src_list ->tail = sb->prev;
-	if(sb->next != NULL)
-		(sb->next)->prev = sb->prev;
-	if(sb->prev != NULL)
-		(sb->prev)->next = sb->next;
+	unlink_superblock(src_list, sb);
 	/*add sb to the head of the destination*/
 	sb->prev = NULL;
 	sb->next = dst_list->head;
@@ -184,208 +1154,1831 @@ static void move_superblock(superblockHeader *sb, memHeap *src, memHeap *dst, in
 		dst_list->tail = sb;
 	dst_list->head = sb;
 	/*move sb to it's appropriate place in the list according to its fullness*/
-	while(sb->next != NULL && sb->usedBlocks < (sb->next)->usedBlocks)
+	while(sb->next != NULL && sb->countedBlocks < (sb->next)->countedBlocks)
 	{
 		swap_superblocks(dst_list,sb);
 	}
-	sb->parentHeap = dst;
+	__atomic_store_n(&(sb->parentHeap), dst, __ATOMIC_RELEASE);
 	/*update statistics*/
-	src_class->usedBlocks -= sb->usedBlocks;
+	src_class->usedBlocks -= sb->countedBlocks;
 	src_class->numOfBlocks -= sb->numOfBlocks;
-	dst_class->usedBlocks += sb->usedBlocks;
+	dst_class->usedBlocks += sb->countedBlocks;
 	dst_class->numOfBlocks += sb->numOfBlocks;
+	src_class->transfersOut++;
+	dst_class->transfersIn++;
 }
 
-/*initialize a superblock*/
-static int init_superblock(superblockHeader *sb, int class)
+/*Take the emptiest superblock of a class from a sibling CPU heap, if at most STEAL_FRACTION of it is used, into the same locked class of heap.
+Siblings keep superblocks the invariant allows them, so a heap that starves while its siblings hold mostly empty ones would otherwise map new ones.
+The siblings' locks are only tried, since heap's is already held. A sibling's last superblock of the class isn't taken*/
+static superblockHeader * steal_superblock(memHeap *heap, int class)
 {
-	sb->usedBlocks = 0;
-	/*in this implementation, the superblock header "steals" memory from the superblock, in order to keep the superblock size 64K. The block headers, however, don't "steal" from the block size because we want to be able to give the user up to 2^class bytes. therefore, the number of blocks in a super block is as following:
-note:this does cause internal fragmentation inside the superblock(for example, a superblock from class 15 will have only 1 block!), but it does have the advantages listed above*/
-	sb->numOfBlocks = (SUPERBLOCK_SIZE-sizeof(superblockHeader)) / (sizeof(blockHeader) + SIZE_OF_CLASS(class));
-	if(pthread_mutex_init(&(sb->lock), NULL))
-	{
-		perror(NULL);
-		return 1;
-	}
-	/*initialize the blocks*/
-	(sb->freeList).head = (blockHeader*)(sb + 1);
-	blockHeader *p = (sb->freeList).head;
-	int i;
-	for(i=0; i<sb->numOfBlocks; i++)
+	unsigned int i, numOfHeaps = __atomic_load_n(&activeHeaps, __ATOMIC_RELAXED);
+	for(i=0; i<numOfHeaps; i++)
 	{
-		p->blockSize = SIZE_OF_CLASS(class);
-		p->inUse = 0;	
-		p->next = (blockHeader*)(((char*)(p) + sizeof(blockHeader) + SIZE_OF_CLASS(class)));
-		p->parentSuperblock = sb;
-		p=p->next;
+		memHeap *sibling = &heaps[i];
+		sizeClass *victim = &(sibling->classes[class]);
+		if(sibling == heap || victim->superblocks.head == victim->superblocks.tail || lock_try(&(victim->lock)))
+			continue;
+		superblockHeader *sb = victim->superblocks.tail;
+		if(sb != NULL && sb != victim->superblocks.head)
+		{
+			reconcile_superblock(victim, sb);
+			if(sb->countedBlocks <= STEAL_FRACTION*sb->numOfBlocks)
+			{
+				/*a free in flight may have counted its block but not marked it yet, and the thief takes a block right away*/
+				settle_superblock(sb);
+				move_superblock(sb, sibling, heap, class);
+				/*move_superblock counts transfers to and from the global heap*/
+				victim->transfersOut--;
+				heap->classes[class].transfersIn--;
+				heap->classes[class].steals++;
+				lock_release(&(victim->lock));
+				return sb;
+			}
+		}
+		lock_release(&(victim->lock));
 	}
-	return 0;
+	return NULL;
 }
 
-/*TODO Break into functions*/
+/*check whether a size class has more empty space than the invariant allows.
+emptyFraction is the allowed fraction and sbBlocks is the number of blocks in one of the class' superblocks*/
+static int breaks_invariant(sizeClass *sc, unsigned int sbBlocks, double emptyFraction)
+{
+	return sc->usedBlocks + config.minSuperblocks*sbBlocks < sc->numOfBlocks && (float) (sc->usedBlocks) < (1-emptyFraction)*(sc->numOfBlocks);
+}
+
+/*the thread's next pseudo random number(xorshift)*/
+static unsigned int next_random()
+{
+	if(randomState == 0)
+		randomState = (unsigned int)(unsigned long)&randomState | 1;
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+/*initialize a superblock*/
+static int init_superblock(superblockHeader *sb, int class)
+{
+	sb->countedBlocks = 0;
+	sb->class = class;
+	sb->meshedInto = NULL;
+	sb->samples = 0;	/*a meshed superblock may keep the count of blocks that were freed through the one it was meshed into*/
+	/*neither the superblock header nor the blocks take space from the superblock, so the blocks fill it exactly.
+	Blocks bigger than a cache line leave one block's worth of space for the coloring below
+	note:this does cause internal fragmentation inside the superblock(for example, a superblock from class 15 will have only 1 block!)*/
+	sb->numOfBlocks = SUPERBLOCK_SIZE / SIZE_OF_CLASS(class);
+	if(SIZE_OF_CLASS(class) > CACHE_LINE)
+		sb->numOfBlocks--;
+	/*the space the blocks leave over shifts the first block by a different number of cache lines in consecutive superblocks,
+	so blocks at the same index in different superblocks don't all fall into the same cache sets*/
+	unsigned int colors = (SUPERBLOCK_SIZE - sb->numOfBlocks*SIZE_OF_CLASS(class)) / CACHE_LINE + 1;
+	sb->color = (__atomic_fetch_add(&nextColor, 1, __ATOMIC_RELAXED) % colors) * CACHE_LINE;
+	/*all the blocks are free*/
+	unsigned long *bitmap = BITMAP_OF(sb);
+	memset(bitmap, 0, BITMAP_WORDS*sizeof(unsigned long));
+	memset(bitmap, 0xFF, sb->numOfBlocks/64*sizeof(unsigned long));
+	if(sb->numOfBlocks % 64 != 0)
+		bitmap[sb->numOfBlocks/64] = (1UL << (sb->numOfBlocks % 64)) - 1;
+	sb->state = 0;
+	return 0;
+}
+
+/*freeze a superblock, frees to it wait until its state is stored again. Returns the frozen state*/
+static unsigned int freeze_superblock(superblockHeader *sb)
+{
+	unsigned int state = __atomic_load_n(&(sb->state), __ATOMIC_ACQUIRE);
+	while(!__atomic_compare_exchange_n(&(sb->state), &state, state | STATE_FROZEN, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return state | STATE_FROZEN;
+}
+
+/*wait until the frees that already counted a block of a superblock as free have marked it in the bitmap.
+Nothing may be taken from the superblock meanwhile(its class is locked), and it must be frozen or have no used blocks, so no new frees start*/
+static void settle_superblock(superblockHeader *sb)
+{
+	unsigned long *bitmap = BITMAP_OF(sb);
+	unsigned int w, freeBlocks;
+	do
+	{
+		freeBlocks = 0;
+		for(w=0; w<(sb->numOfBlocks + 63) / 64; w++)
+			freeBlocks += __builtin_popcountl(__atomic_load_n(&(bitmap[w]), __ATOMIC_ACQUIRE));
+	} while(freeBlocks != sb->numOfBlocks - STATE_USED(__atomic_load_n(&(sb->state), __ATOMIC_ACQUIRE)) && (sched_yield(), 1));
+}
+
+/*check that every block is free in at least one of two superblocks*/
+static int disjoint(unsigned long *freeA, unsigned long *freeB, unsigned int numOfBlocks)
+{
+	unsigned int i;
+	for(i=0; i<numOfBlocks; i++)
+	{
+		if(!TEST_BIT(freeA, i) && !TEST_BIT(freeB, i))
+			return 0;
+	}
+	return 1;
+}
+
+/*remap the aliases of an empty superblock back onto their own(released) pages and make their slots reusable*/
+static void release_aliases(superblockHeader *sb)
+{
+	unsigned int s, slot = SLOT_OF(sb);
+	pthread_mutex_lock(&(sbRegion.lock));
+	for(s=0; s<sbRegion.nextSlot && meshSpace.aliases[slot] > 0; s++)
+	{
+		if(meshSpace.targets[s] == slot + 1 && mmap(SLOT_DATA(s), SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, meshSpace.fd, (off_t)s * SUPERBLOCK_SIZE) != MAP_FAILED)
+		{
+			page_map_set(SLOT_DATA(s), SUPERBLOCK_SIZE, 0);
+			meshSpace.targets[s] = 0;
+			meshSpace.aliases[slot]--;
+			sbRegion.freeSlots[sbRegion.numOfFreeSlots++] = s;
+		}
+	}
+	pthread_mutex_unlock(&(sbRegion.lock));
+}
+
+/*release the pages of an empty superblock of a locked class and make its slot reusable*/
+static int release_superblock(sizeClass *sc, superblockHeader *sb)
+{
+	if(ALIASES_OF(sb) > 0)
+		release_aliases(sb);
+	if(ALIASES_OF(sb) > 0)
+		return 0;
+	/*nothing can be freed to an empty superblock, and nothing is allocated from it while the class is locked*/
+	settle_superblock(sb);
+	unlink_superblock(&(sc->superblocks), sb);
+	sc->numOfBlocks -= sb->numOfBlocks;
+	sc->usedBlocks -= sb->countedBlocks;
+	page_map_set(DATA_OF(sb), SUPERBLOCK_SIZE, 0);
+	if(fallocate(meshSpace.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)SLOT_OF(sb) * SUPERBLOCK_SIZE, SUPERBLOCK_SIZE))
+		perror(NULL);
+	pthread_mutex_lock(&(sbRegion.lock));
+	sbRegion.freeSlots[sbRegion.numOfFreeSlots++] = SLOT_OF(sb);
+	pthread_mutex_unlock(&(sbRegion.lock));
+	return 1;
+}
+
+/*add a superblock at the head of a list*/
+static void push_superblock(superblockList *list, superblockHeader *sb)
+{
+	sb->prev = NULL;
+	sb->next = list->head;
+	if(list->head != NULL)
+		(list->head)->prev = sb;
+	else
+		list->tail = sb;
+	list->head = sb;
+}
+
+/*return the pages of the superblocks that were in the pool longer than the decay time to the OS. The pool must be locked.
+Only the blocks area is released, the headers live apart from it*/
+static void purge_empty_superblocks(unsigned long now)
+{
+	superblockHeader *sb;
+	/*the background thread's prefaulted reserve is kept*/
+	unsigned int keep = __atomic_load_n(&(background.running), __ATOMIC_RELAXED) ? config.prefault : 0;
+	while((sb = emptySuperblocks.warm.tail) != NULL && now - sb->emptySince >= config.purgeDecay && emptySuperblocks.numOfWarm > keep)
+	{
+		unlink_superblock(&(emptySuperblocks.warm), sb);
+		emptySuperblocks.numOfWarm--;
+		if(MESHING_ENABLED)
+		{
+			if(fallocate(meshSpace.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)SLOT_OF(sb) * SUPERBLOCK_SIZE, SUPERBLOCK_SIZE))
+				perror(NULL);
+		}
+		/*a superblock of the locked pool keeps its pages, it's only moved behind the warm ones*/
+		else if(SLOT_OF(sb) >= lockedSlots && madvise(DATA_OF(sb), SUPERBLOCK_SIZE, MADV_DONTNEED))
+			perror(NULL);
+		push_superblock(&(emptySuperblocks.cold), sb);
+	}
+}
+
+/*move an empty superblock from a locked class to the empty superblocks pool.
+Returns 0 if the superblock can't leave the class(other meshed slots are still mapped onto its pages)*/
+static int recycle_superblock(sizeClass *sc, superblockHeader *sb)
+{
+	if(ALIASES_OF(sb) > 0)
+	{
+		release_aliases(sb);
+		if(ALIASES_OF(sb) > 0)
+			return 0;
+	}
+	settle_superblock(sb);
+	unlink_superblock(&(sc->superblocks), sb);
+	sc->numOfBlocks -= sb->numOfBlocks;
+	sc->usedBlocks -= sb->countedBlocks;
+	if(IS_PRIVATE(sb->parentHeap))
+		__atomic_sub_fetch(&(((mtmm_heap_t *)sb->parentHeap)->size), SUPERBLOCK_SIZE, __ATOMIC_RELAXED);
+	__atomic_store_n(&(sb->parentHeap), NULL, __ATOMIC_RELEASE);
+	sb->emptySince = now_ms();
+	pthread_mutex_lock(&(emptySuperblocks.lock));
+	push_superblock(&(emptySuperblocks.warm), sb);
+	emptySuperblocks.numOfWarm++;
+	/*with the background thread running, the purging is left to it*/
+	if(!__atomic_load_n(&(background.running), __ATOMIC_RELAXED))
+		purge_empty_superblocks(sb->emptySince);
+	pthread_mutex_unlock(&(emptySuperblocks.lock));
+	return 1;
+}
+
+/*move every superblock of a list to the empty superblocks pool as they are, whatever their blocks hold.
+init_superblock formats them again when they're reused*/
+static void pool_superblocks(superblockList *list)
+{
+	superblockHeader *sb;
+	unsigned long now = now_ms();
+	pthread_mutex_lock(&(emptySuperblocks.lock));
+	while((sb = list->head) != NULL)
+	{
+		unlink_superblock(list, sb);
+		__atomic_store_n(&(sb->parentHeap), NULL, __ATOMIC_RELEASE);
+		sb->emptySince = now;
+		push_superblock(&(emptySuperblocks.warm), sb);
+		emptySuperblocks.numOfWarm++;
+	}
+	if(!__atomic_load_n(&(background.running), __ATOMIC_RELAXED))
+		purge_empty_superblocks(now);
+	pthread_mutex_unlock(&(emptySuperblocks.lock));
+}
+
+/*Reserve the locked pool at start: the first slots of the region are faulted in and locked in memory with their headers, bitmaps and page map
+levels, and put in the empty superblocks pool, from where each class formats the ones it needs. The heaps and the sampling tables are locked as well.
+Afterwards superblocks come from the OS only if the exhausted policy allows it. It fails if the memory can't be locked(see RLIMIT_MEMLOCK)*/
+static void init_locked_pool()
+{
+	unsigned int s;
+	unsigned long slots = (config.lockedBytes + SUPERBLOCK_SIZE - 1) / SUPERBLOCK_SIZE;
+	if(slots > sbRegion.numOfSlots)
+		slots = sbRegion.numOfSlots;
+	while(sbRegion.openSlots < slots)
+	{
+		if(open_slots())
+			INIT_EXIT("mtmm: can't lock the preallocated pool\n")
+	}
+	if(page_map_set(sbRegion.base, slots * SUPERBLOCK_SIZE, 0) != 0
+		|| mlock(sbRegion.base, slots * SUPERBLOCK_SIZE) || mlock(sbRegion.headers, slots * sizeof(superblockHeader))
+		|| mlock(sbRegion.bitmaps, slots * sizeof(*sbRegion.bitmaps)) || mlock(heaps, sizeof(heaps)) || mlock(globalPools, sizeof(globalPools))
+		|| mlock(sampledBlocks, sizeof(sampledBlocks)) || mlock(tagBytes, sizeof(tagBytes)))
+		INIT_EXIT("mtmm: can't lock the preallocated pool\n")
+	lockedSlots = slots;
+	sbRegion.nextSlot = slots;
+	unsigned long now = now_ms();
+	for(s=slots; s>0; s--)
+	{
+		superblockHeader *sb = &(sbRegion.headers[s-1]);
+		sb->emptySince = now;
+		push_superblock(&(emptySuperblocks.warm), sb);
+		emptySuperblocks.numOfWarm++;
+	}
+}
+
+/*wake the background thread for a pass before its interval is over. Only the first request of a pass makes a system call*/
+static void request_background_pass()
+{
+	if(__atomic_exchange_n(&(background.requested), 1, __ATOMIC_RELEASE) == 0)
+		syscall(SYS_futex, &(background.requested), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*take a superblock from the empty superblocks pool, preferring one that still has its pages. Returns NULL if the pool is empty.
+The superblock has to be formatted(init_superblock) for its new class*/
+static superblockHeader * reuse_superblock()
+{
+	superblockHeader *sb;
+	int running = __atomic_load_n(&(background.running), __ATOMIC_RELAXED);
+	pthread_mutex_lock(&(emptySuperblocks.lock));
+	if(!running)
+		purge_empty_superblocks(now_ms());
+	if((sb = emptySuperblocks.warm.head) != NULL)
+	{
+		unlink_superblock(&(emptySuperblocks.warm), sb);
+		emptySuperblocks.numOfWarm--;
+	}
+	else if((sb = emptySuperblocks.cold.head) != NULL)
+		unlink_superblock(&(emptySuperblocks.cold), sb);
+	if(sb != NULL)
+		emptySuperblocks.reused++;
+	int refill = running && emptySuperblocks.numOfWarm < config.prefault;
+	pthread_mutex_unlock(&(emptySuperblocks.lock));
+	/*the prefaulted reserve ran low, the background thread refills it*/
+	if(refill)
+		request_background_pass();
+	return sb;
+}
+
+/*Mesh superblock b into superblock a. Both belong to the same locked class.
+freeA and freeB receive their exact free blocks bitmaps.
+b's live blocks are copied to the same offsets in a, then b's addresses are mapped onto a's pages and b's pages are released.
+Returns 0 if the superblocks can't be meshed*/
+static int mesh_pair(int class, superblockHeader *a, superblockHeader *b, unsigned long *freeA, unsigned long *freeB)
+{
+	unsigned int i, stride = SIZE_OF_CLASS(class);
+	/*frees to a and b wait from here on, once the ones in flight are done the bitmaps are exact*/
+	unsigned int stateA = freeze_superblock(a);
+	unsigned int stateB = freeze_superblock(b);
+	settle_superblock(a);
+	settle_superblock(b);
+	memcpy(freeA, BITMAP_OF(a), BITMAP_WORDS*sizeof(unsigned long));
+	memcpy(freeB, BITMAP_OF(b), BITMAP_WORDS*sizeof(unsigned long));
+	if(!disjoint(freeA, freeB, a->numOfBlocks))
+	{
+		__atomic_store_n(&(a->state), stateA & ~STATE_FROZEN, __ATOMIC_RELEASE);
+		__atomic_store_n(&(b->state), stateB & ~STATE_FROZEN, __ATOMIC_RELEASE);
+		return 0;
+	}
+	/*write protect b, a thread that writes to one of its blocks waits in mesh_fault_handler until b is remapped.
+	A system call that writes to it fails with EFAULT instead, there's no fault to wait in(see the mesh tunable in mtmm.h)*/
+	__atomic_store_n(&(meshSpace.meshing), b, __ATOMIC_RELEASE);
+	if(mprotect(DATA_OF(b), SUPERBLOCK_SIZE, PROT_READ))
+	{
+		__atomic_store_n(&(meshSpace.meshing), NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&(a->state), stateA & ~STATE_FROZEN, __ATOMIC_RELEASE);
+		__atomic_store_n(&(b->state), stateB & ~STATE_FROZEN, __ATOMIC_RELEASE);
+		return 0;
+	}
+	for(i=0; i<a->numOfBlocks; i++)
+	{
+		if(!TEST_BIT(freeB, i))
+			memcpy(BLOCK_AT(a, i, stride), BLOCK_AT(b, i, stride), stride);
+	}
+	if(mmap(DATA_OF(b), SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, meshSpace.fd, (off_t)SLOT_OF(a) * SUPERBLOCK_SIZE) == MAP_FAILED)
+	{
+		/*the copies only overwrote a's free blocks, which hold nothing*/
+		perror(NULL);
+		mprotect(DATA_OF(b), SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE);
+		__atomic_store_n(&(meshSpace.meshing), NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&(a->state), stateA & ~STATE_FROZEN, __ATOMIC_RELEASE);
+		__atomic_store_n(&(b->state), stateB & ~STATE_FROZEN, __ATOMIC_RELEASE);
+		return 0;
+	}
+	/*Frees that look b's blocks up from here on find a. The ones that already found b wait on b's frozen state until it points to a.
+	b stays frozen until its slot is used again. b's sampled blocks are a's now, a free that found b still takes its count from b*/
+	__atomic_add_fetch(&(a->samples), __atomic_load_n(&(b->samples), __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	page_map_set(DATA_OF(b), SUPERBLOCK_SIZE, PAGE_ENTRY(a, PAGE_SUPERBLOCK));
+	for(i=0; i<BITMAP_WORDS; i++)
+		BITMAP_OF(a)[i] = freeA[i] & freeB[i];
+	__atomic_store_n(&(a->state), STATE_USED(stateA) + STATE_USED(stateB), __ATOMIC_RELEASE);
+	__atomic_store_n(&(b->meshedInto), a, __ATOMIC_RELEASE);
+	__atomic_store_n(&(meshSpace.meshing), NULL, __ATOMIC_RELEASE);
+	if(fallocate(meshSpace.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)SLOT_OF(b) * SUPERBLOCK_SIZE, SUPERBLOCK_SIZE))
+		perror(NULL);
+	pthread_mutex_lock(&(sbRegion.lock));
+	meshSpace.targets[SLOT_OF(b)] = SLOT_OF(a) + 1;
+	meshSpace.aliases[SLOT_OF(a)]++;
+	pthread_mutex_unlock(&(sbRegion.lock));
+	return 1;
+}
+
+/*Mesh the sparse superblocks of a locked class. Returns the number of superblocks whose pages were released*/
+static unsigned int mesh_sizeclass(sizeClass *sc, int class)
+{
+	superblockHeader *candidates[MESH_CANDIDATES];
+	unsigned long freeBits[MESH_CANDIDATES][BITMAP_WORDS];
+	unsigned int i, j, n = 0, released = 0;
+	reconcile_sizeclass(sc);
+	/*the list is sorted by fullness, so the candidates are at its tail. At most half full superblocks can mesh*/
+	superblockHeader *sb = sc->superblocks.tail, *prev;
+	for(; sb != NULL && n < MESH_CANDIDATES; sb = prev)
+	{
+		prev = sb->prev;
+		unsigned int used = STATE_USED(__atomic_load_n(&(sb->state), __ATOMIC_ACQUIRE));
+		if(used*2 > sb->numOfBlocks)
+			break;
+		if(used == 0 && release_superblock(sc, sb))
+		{
+			released++;
+			continue;
+		}
+		candidates[n] = sb;
+		memcpy(freeBits[n], BITMAP_OF(sb), sizeof(freeBits[n]));
+		n++;
+	}
+	/*Blocks are only taken while the class is locked, so the bitmaps can only miss free blocks. Pairs that look disjoint are checked again after freezing*/
+	for(i=0; i<n; i++)
+	{
+		for(j=i+1; j<n && candidates[i] != NULL; j++)
+		{
+			/*the blocks of both superblocks have to be at the same offsets*/
+			if(candidates[j] == NULL || candidates[j]->color != candidates[i]->color || !disjoint(freeBits[i], freeBits[j], candidates[i]->numOfBlocks))
+				continue;
+			/*a superblock that other slots are mapped onto has to keep its pages*/
+			int keep = i, drop = j;
+			if(meshSpace.aliases[SLOT_OF(candidates[j])] > 0)
+			{
+				if(meshSpace.aliases[SLOT_OF(candidates[i])] > 0)
+					continue;
+				keep = j;
+				drop = i;
+			}
+			superblockHeader *a = candidates[keep], *b = candidates[drop];
+			unsigned int counted = b->countedBlocks;
+			unlink_superblock(&(sc->superblocks), b);
+			if(!mesh_pair(class, a, b, freeBits[keep], freeBits[drop]))
+			{
+				/*put b back at the tail, the next reconciliation sorts it*/
+				b->next = NULL;
+				b->prev = sc->superblocks.tail;
+				if(sc->superblocks.tail != NULL)
+					(sc->superblocks.tail)->next = b;
+				else
+					sc->superblocks.head = b;
+				sc->superblocks.tail = b;
+				continue;
+			}
+			a->countedBlocks += counted;
+			sc->numOfBlocks -= a->numOfBlocks;
+			while(a->prev != NULL && a->countedBlocks > (a->prev)->countedBlocks)
+			{
+				swap_superblocks(&(sc->superblocks), a->prev);
+			}
+			candidates[drop] = NULL;
+			released++;
+		}
+	}
+	return released;
+}
+
+size_t mtmm_mesh()
+{
+	int i, j;
+	size_t released = 0;
+	ensure_init();
+	if(!MESHING_ENABLED)
+		return 0;
+	pthread_mutex_lock(&(meshSpace.passLock));
+	for(i=0; i<MAX_OF_CPUS + config.numOfPools; i++)
+	{
+		memHeap *heap = i < MAX_OF_CPUS ? &heaps[i] : &globalPools[i - MAX_OF_CPUS];
+		for(j=0; j<NUM_OF_CLASSES; j++)
+		{
+			lock_acquire(&(heap->classes[j].lock));
+			released += mesh_sizeclass(&(heap->classes[j]), j);
+			lock_release(&(heap->classes[j].lock));
+		}
+	}
+	meshSpace.meshedSuperblocks += released;
+	pthread_mutex_unlock(&(meshSpace.passLock));
+	return released * SUPERBLOCK_SIZE;
+}
+
+/*run a mesh pass if the interval since the last one has passed. Only one of the threads that notice runs it*/
+static void mesh_if_due()
+{
+	unsigned long ms = now_ms();
+	unsigned long last = __atomic_load_n(&(meshSpace.lastPass), __ATOMIC_RELAXED);
+	if(ms - last >= config.meshInterval && __atomic_compare_exchange_n(&(meshSpace.lastPass), &last, ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		mtmm_mesh();
+}
+
+/*the run right after a run in its span, or NULL if it's the last one*/
+static runHeader * next_run(runHeader *run)
+{
+	char *next = (char *)run + run->pages*PAGE_SIZE;
+	return next < run->span->end ? (runHeader *)next : NULL;
+}
+
+/*put a free run in its bin. The medium heap must be locked*/
+static void insert_run(runHeader *run)
+{
+	unsigned long bin = RUN_BIN(run->pages);
+	runHeader *prev = NULL, *next = mediumBlocks.bins[bin];
+	if(bin == MEDIUM_BINS - 1) /*the last bin is sorted, so its first fitting run is the best fit*/
+	{
+		while(next != NULL && next->pages < run->pages)
+		{
+			prev = next;
+			next = next->next;
+		}
+	}
+	run->isFree = 1;
+	run->prev = prev;
+	run->next = next;
+	if(next != NULL)
+		next->prev = run;
+	if(prev != NULL)
+		prev->next = run;
+	else
+		mediumBlocks.bins[bin] = run;
+	mediumBlocks.nonEmptyBins[bin/64] |= 1UL << (bin%64);
+}
+
+/*take a free run out of its bin. The medium heap must be locked*/
+static void remove_run(runHeader *run)
+{
+	unsigned long bin = RUN_BIN(run->pages);
+	if(run->prev != NULL)
+		(run->prev)->next = run->next;
+	else
+		mediumBlocks.bins[bin] = run->next;
+	if(run->next != NULL)
+		(run->next)->prev = run->prev;
+	if(mediumBlocks.bins[bin] == NULL)
+		mediumBlocks.nonEmptyBins[bin/64] &= ~(1UL << (bin%64));
+	run->isFree = 0;
+}
+
+/*find the shortest free run of at least the given number of pages and take it out of its bin, or return NULL.
+The medium heap must be locked*/
+static runHeader * find_run(unsigned long pages)
+{
+	unsigned long bin = RUN_BIN(pages);
+	unsigned long word = bin/64;
+	unsigned long bits = mediumBlocks.nonEmptyBins[word] & (~0UL << (bin%64));
+	while(bits == 0 && ++word < MEDIUM_BINS/64)
+		bits = mediumBlocks.nonEmptyBins[word];
+	if(bits == 0)
+		return NULL;
+	runHeader *run = mediumBlocks.bins[word*64 + __builtin_ctzl(bits)];
+	while(run != NULL && run->pages < pages) /*only in the last bin*/
+		run = run->next;
+	if(run != NULL)
+		remove_run(run);
+	return run;
+}
+
+static void medium_free(runHeader *run);
+
+/*return the pages of every free run, all but its header page, to the OS. The medium heap must be locked*/
+static void purge_free_runs(void)
+{
+	unsigned long bin;
+	runHeader *run;
+	for(bin = 0; bin < MEDIUM_BINS; bin++)
+	{
+		for(run = mediumBlocks.bins[bin]; run != NULL; run = run->next)
+		{
+			if(run->pages > 1 && madvise((char *)run + PAGE_SIZE, (run->pages - 1)*PAGE_SIZE, MADV_DONTNEED))
+				perror(NULL);
+		}
+	}
+	mediumBlocks.dirtyPages = 0;
+}
+
+/*allocate a "large" block from a run of pages*/
+static void * medium_malloc(size_t sz)
+{
+	unsigned long pages = RUN_PAGES(sz);
+	pthread_mutex_lock(&(mediumBlocks.lock));
+	runHeader *run = find_run(pages);
+	if(run == NULL)
+	{
+		/*reserve a new span, its pages are only backed once they're touched. The locked pool holds no spans, they come from the OS either way*/
+		mediumSpan *span = (mediumSpan *)fetch_memory(MEDIUM_SPAN_SIZE);
+		if(span == NULL)
+		{
+			pthread_mutex_unlock(&(mediumBlocks.lock));
+			return NULL;
+		}
+		span->end = (char *)span + MEDIUM_SPAN_SIZE;
+		span->next = mediumBlocks.spans;
+		mediumBlocks.spans = span;
+		mediumBlocks.numOfSpans++;
+		run = (runHeader *)((char *)span + PAGE_SIZE);
+		run->pages = (MEDIUM_SPAN_SIZE - PAGE_SIZE) / PAGE_SIZE;
+		run->prevPages = 0;
+		run->span = span;
+	}
+	else /*the run takes some of the freed pages that are still backed*/
+		mediumBlocks.dirtyPages -= pages < mediumBlocks.dirtyPages ? pages : mediumBlocks.dirtyPages;
+	/*split off the pages that aren't needed*/
+	if(run->pages > pages)
+	{
+		runHeader *rest = (runHeader *)((char *)run + pages*PAGE_SIZE);
+		rest->pages = run->pages - pages;
+		rest->prevPages = pages;
+		rest->span = run->span;
+		run->pages = pages;
+		if(next_run(rest) != NULL)
+			next_run(rest)->prevPages = rest->pages;
+		insert_run(rest);
+	}
+	pthread_mutex_unlock(&(mediumBlocks.lock));
+	run->heap = NULL;
+	/*only the run's first page is mapped, the block starts in it*/
+	if(page_map_set(run, PAGE_SIZE, PAGE_ENTRY(run, PAGE_RUN)))
+	{
+		medium_free(run);
+		return NULL;
+	}
+	return (run + 1);
+}
+
+/*free a "large" block's run, coalescing it with the free runs around it. A span that becomes completely free is returned to the OS, unless it's the last one.
+Once enough pages were freed, the pages of all the free runs are returned to the OS*/
+static void medium_free(runHeader *run)
+{
+	page_map_set(run, PAGE_SIZE, 0);
+	pthread_mutex_lock(&(mediumBlocks.lock));
+	mediumBlocks.dirtyPages += run->pages;
+	runHeader *next = next_run(run);
+	if(next != NULL && next->isFree)
+	{
+		remove_run(next);
+		run->pages += next->pages;
+	}
+	if(run->prevPages != 0)
+	{
+		runHeader *prev = (runHeader *)((char *)run - run->prevPages*PAGE_SIZE);
+		if(prev->isFree)
+		{
+			remove_run(prev);
+			prev->pages += run->pages;
+			run = prev;
+		}
+	}
+	next = next_run(run);
+	if(next != NULL)
+		next->prevPages = run->pages;
+	else if(run->prevPages == 0 && mediumBlocks.numOfSpans > 1)
+	{
+		mediumSpan **p = &(mediumBlocks.spans);
+		while(*p != run->span)
+			p = &((*p)->next);
+		*p = run->span->next;
+		mediumBlocks.numOfSpans--;
+		mediumBlocks.dirtyPages -= run->pages < mediumBlocks.dirtyPages ? run->pages : mediumBlocks.dirtyPages;
+		if(munmap(run->span, MEDIUM_SPAN_SIZE))
+			perror(NULL);
+		pthread_mutex_unlock(&(mediumBlocks.lock));
+		return;
+	}
+	insert_run(run);
+	if(mediumBlocks.dirtyPages > MEDIUM_DIRTY_PAGES)
+		purge_free_runs();
+	pthread_mutex_unlock(&(mediumBlocks.lock));
+}
+
+/*look up the page map entry of a pointer that malloc returned. Returns 0 if the allocator doesn't own the pointer or it isn't the start of a block*/
+static unsigned long lookup_block(void *ptr)
+{
+	unsigned long entry = page_lookup(ptr);
+	if(PAGE_KIND(entry) == PAGE_SUPERBLOCK)
+	{
+		superblockHeader *sb = PAGE_RECORD(entry);
+		unsigned long stride = SIZE_OF_CLASS(sb->class);
+		unsigned long offset = BLOCK_OFFSET(sb, ptr);
+		if(offset >= sb->numOfBlocks*stride || offset % stride != 0)
+			return 0;
+	}
+	else if(PAGE_KIND(entry) == PAGE_RUN && ptr != (runHeader *)PAGE_RECORD(entry) + 1)
+		return 0;
+	else if(PAGE_KIND(entry) == PAGE_LARGE && ptr != (largeHeader *)PAGE_RECORD(entry) + 1)
+		return 0;
+	return entry;
+}
+
+/*draw the bytes until the thread's next sample, uniformly around the sampling interval*/
+static void draw_sample_distance()
+{
+	bytesUntilSample = sampleDistance = config.sampleInterval/2 + next_random() % (config.sampleInterval + 1);
+}
+
+/*Account a sampled allocation to the thread's tag. It stands for the bytes the thread allocated since its previous sample, so
+the weights add up to every byte allocated, however big the blocks are relative to the interval*/
+static void sample_allocation(void *block)
+{
+	unsigned int i, slot = SAMPLE_SLOT(block);
+	long weight = sampleDistance - bytesUntilSample;
+	int started = sampleDistance != 0;
+	draw_sample_distance();
+	if(!started || block == NULL)
+		return;
+	for(i=0; i<SAMPLE_PROBES; i++)
+	{
+		sampledBlock *s = &sampledBlocks[(slot + i) % SAMPLE_SLOTS];
+		void *empty = NULL;
+		if(__atomic_compare_exchange_n(&(s->block), &empty, block, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			s->tag = currentTag;
+			s->weight = weight;
+			__atomic_add_fetch(&(tagBytes[HASH(pthread_self())][s->tag]), s->weight, __ATOMIC_RELAXED);
+			unsigned long entry = page_lookup(block);
+			if(PAGE_KIND(entry) == PAGE_SUPERBLOCK)
+				__atomic_add_fetch(&(((superblockHeader *)PAGE_RECORD(entry))->samples), 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	/*the table is crowded around the block, the sample is dropped*/
+	__atomic_add_fetch(&droppedSamples, 1, __ATOMIC_RELAXED);
+}
+
+/*take a block that's being freed out of the sampled allocations, if it's there. Returns whether it was*/
+static int unsample_block(void *block)
+{
+	unsigned int i, slot = SAMPLE_SLOT(block);
+	for(i=0; i<SAMPLE_PROBES; i++)
+	{
+		sampledBlock *s = &sampledBlocks[(slot + i) % SAMPLE_SLOTS];
+		if(__atomic_load_n(&(s->block), __ATOMIC_ACQUIRE) == block)
+		{
+			__atomic_sub_fetch(&(tagBytes[HASH(pthread_self())][s->tag]), s->weight, __ATOMIC_RELAXED);
+			__atomic_store_n(&(s->block), NULL, __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*the CPU heap the thread allocates from*/
+static inline memHeap * thread_heap()
+{
+	if(boundHeap != NULL)
+		return boundHeap;
+	return hoppedHeap != NULL ? hoppedHeap : &(heaps[HASH(pthread_self())]);
+}
+
+/*Count a busy heap lock. When the locks are often busy the threads are spread over one more CPU heap, up to maxHeaps.
+The counter and its window are only a hint, a race between threads that reset them costs at most a few counts*/
+static void note_contention()
+{
+	unsigned long now = now_ms();
+	if(now - __atomic_load_n(&contentionWindow, __ATOMIC_RELAXED) >= HEAP_GROW_WINDOW)
+	{
+		__atomic_store_n(&contentionWindow, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&contendedLocks, 0, __ATOMIC_RELAXED);
+	}
+	if(__atomic_add_fetch(&contendedLocks, 1, __ATOMIC_RELAXED) >= HEAP_GROW_CONTENTION)
+	{
+		unsigned int numOfHeaps = __atomic_load_n(&activeHeaps, __ATOMIC_RELAXED);
+		__atomic_store_n(&contendedLocks, 0, __ATOMIC_RELAXED);
+		if(numOfHeaps < config.maxHeaps)
+			__atomic_compare_exchange_n(&activeHeaps, &numOfHeaps, numOfHeaps + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+/*make sure thread_exit runs when the thread exits. Called before any lock is taken, pthread_setspecific may allocate*/
+static inline void register_thread()
+{
+	if(!threadRegistered)
+	{
+		threadRegistered = 1;
+		pthread_setspecific(threadKey, &threadRegistered);
+	}
+}
+
+/*Lock a class of the thread's heap and return the heap. If the lock is busy the thread moves on to the next CPU heap whose lock is free,
+and keeps using that one(like ptmalloc's arenas), so threads that collide spread out instead of queuing. A bound thread always waits for its own heap*/
+static memHeap * lock_thread_heap(int class)
+{
+	unsigned int i;
+	memHeap *heap = thread_heap();
+	register_thread();
+	if(config.backgroundInterval != 0 && !__atomic_load_n(&(background.started), __ATOMIC_RELAXED))
+		start_background();
+	if(lock_try(&(heap->classes[class].lock)) == 0)
+		return heap;
+	note_contention();
+	if(boundHeap == NULL)
+	{
+		unsigned int numOfHeaps = __atomic_load_n(&activeHeaps, __ATOMIC_RELAXED);
+		for(i=1; i<numOfHeaps; i++)
+		{
+			memHeap *next = &heaps[(heap->id + i) % numOfHeaps];
+			if(lock_try(&(next->classes[class].lock)) == 0)
+			{
+				hoppedHeap = next;
+				return next;
+			}
+		}
+	}
+	lock_acquire(&(heap->classes[class].lock));
+	return heap;
+}
+
+/*allocate a block that doesn't fit a span directly from the OS*/
+static void * large_malloc(size_t sz)
+{
+	/*the mapping's size would wrap around, or be more than an object may take(PTRDIFF_MAX) and more than mmap accepts*/
+	if(sz > PTRDIFF_MAX - sizeof(largeHeader) - PAGE_SIZE)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	largeHeader *p = (largeHeader *)fetch_memory(sz+sizeof(largeHeader));
+	if(!p)
+	{
+		perror(NULL);
+		return NULL;
+	}
+	p->size = sz+sizeof(largeHeader);
+	p->blockSize = sz;
+	p->heap = NULL;
+	if(page_map_set(p, PAGE_SIZE, PAGE_ENTRY(p, PAGE_LARGE)))
+	{
+		munmap(p, p->size);
+		return NULL;
+	}
+	return (p+1);
+}
+
+/*return a block that was allocated directly from the OS*/
+static void large_free(largeHeader *large)
+{
+	page_map_set(large, PAGE_SIZE, 0);
+	if(munmap(large, large->size))
+		perror(NULL);
+}
+
+/*free a block that has a run of pages or was allocated directly from the OS, and take it off its private heap's list*/
+static void free_large(unsigned long entry)
+{
+	runHeader *run = PAGE_KIND(entry) == PAGE_RUN ? PAGE_RECORD(entry) : NULL;
+	largeHeader *large = PAGE_KIND(entry) == PAGE_LARGE ? PAGE_RECORD(entry) : NULL;
+	mtmm_heap_t *owner = run != NULL ? run->heap : large->heap;	/*the heap's lock protects its lists, its size is updated atomically*/
+	if(config.sampleInterval != 0)
+		unsample_block(run != NULL ? (void *)(run + 1) : (void *)(large + 1));
+	if(owner != NULL)
+	{
+		pthread_mutex_lock(&(owner->lock));
+		if(run != NULL)
+		{
+			if(run->prev != NULL)
+				run->prev->next = run->next;
+			else
+				owner->runs = run->next;
+			if(run->next != NULL)
+				run->next->prev = run->prev;
+			__atomic_sub_fetch(&(owner->size), run->pages*PAGE_SIZE, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			if(large->prev != NULL)
+				large->prev->next = large->next;
+			else
+				owner->largeBlocks = large->next;
+			if(large->next != NULL)
+				large->next->prev = large->prev;
+			__atomic_sub_fetch(&(owner->size), large->size, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&(owner->lock));
+	}
+	if(run != NULL)
+		medium_free(run);
+	else
+		large_free(large);
+}
+
+/*format an empty superblock of any class for a locked class of a heap, or allocate a new superblock from OS if mayFetch is set, and add it at the class' tail.
+Returns NULL if there's no memory(or the private heap is at its limit), or if the empty superblocks pool is empty and mayFetch isn't set*/
+static superblockHeader * add_superblock(memHeap *heap, int class, int mayFetch)
+{
+	sizeClass *sc = &(heap->classes[class]);
+	if(IS_PRIVATE(heap))
+	{
+		mtmm_heap_t *owner = (mtmm_heap_t *)heap;
+		if(__atomic_add_fetch(&(owner->size), SUPERBLOCK_SIZE, __ATOMIC_RELAXED) > owner->limit && owner->limit != 0)
+		{
+			__atomic_sub_fetch(&(owner->size), SUPERBLOCK_SIZE, __ATOMIC_RELAXED);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	superblockHeader *superblock = reuse_superblock();
+	if(superblock == NULL && mayFetch)
+		superblock = fetch_superblock();
+	else if(superblock == NULL)
+	{
+		if(IS_PRIVATE(heap))
+			__atomic_sub_fetch(&(((mtmm_heap_t *)heap)->size), SUPERBLOCK_SIZE, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if(superblock == NULL || page_map_set(DATA_OF(superblock), SUPERBLOCK_SIZE, PAGE_ENTRY(superblock, PAGE_SUPERBLOCK)) != 0 || init_superblock(superblock, class) != 0)
+	{
+		if(superblock != NULL || config.lockedBytes == 0) /*a used up locked pool is counted instead(see locked_pool_exhausted)*/
+			perror(NULL);
+		if(IS_PRIVATE(heap))
+			__atomic_sub_fetch(&(((mtmm_heap_t *)heap)->size), SUPERBLOCK_SIZE, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	sc->numOfBlocks += superblock->numOfBlocks;
+	/*put the superblock in the sizeclass*/
+	superblock->parentHeap = heap;
+	if(sc->superblocks.tail != NULL)
+		(sc->superblocks.tail)->next = superblock;
+	else
+	{
+		/*the size class is empty so this is also the first superblock*/
+		sc->superblocks.head = superblock;
+	}
+	superblock->prev = sc->superblocks.tail;
+	sc->superblocks.tail = superblock;
+	superblock->next = NULL;
+	return superblock;
+}
+
+/*TODO Break into functions*/
 /*First, the function searches a free block in the CPU's heap.
 If there's none, it searches for one in the global heap.
 If there's none there too, the function allocates a new superblock from the OS and puts it the the heap*/
+static void * malloc_block(size_t sz)
+{
+	/*if this is the first malloc, initialize the heaps*/
+	ensure_init();
+	
+	/*handle allocations for "large" blocks, carve a run of pages for the block*/
+	if(sz > config.sizeThreshold && sz <= MEDIUM_MAX_SIZE)
+		return medium_malloc(sz);
+	/*a block that doesn't fit a span is allocated directly from OS*/
+	if(sz > config.sizeThreshold)
+		return large_malloc(sz);
+	
+	int class = sz <= MIN_BLOCK_SIZE ? MIN_CLASS : (int) ceil(log2(sz)); /*the appropriate size class*/
+	/*a block cached by this thread is the cheapest one to get*/
+	if(tcache.counts[class] > 0)
+	{
+		freeBlock *block = tcache.heads[class];
+		tcache.heads[class] = block->next;
+		tcache.counts[class]--;
+		return block;
+	}
+	memHeap *heap = lock_thread_heap(class); /*lock the heap*/
+	sizeClass *sc = &(heap->classes[class]);
+	superblockHeader *superblock;
+	while((superblock = search_sizeclass(sc)) != NULL) /*search for a free block in the class*/
+	{
+		freeBlock *block = take_block(sc, superblock);
+		if(block != NULL)
+		{
+			lock_release(&(sc->lock)); /*unlock the heap*/
+			return block;
+		}
+		reconcile_sizeclass(sc); /*the counters were stale, fix them before searching again*/
+	}
+	
+	/*try to fetch a superblock from the global heap, starting with the heap's nearest shard, then from the other CPU heaps*/
+	int i;
+	for(i=0; i<config.numOfPools; i++)
+	{
+		memHeap *globalHeap = &globalPools[(NEAREST_POOL(heap) + i) % config.numOfPools];
+		lock_acquire(&(globalHeap->classes[class].lock)); /*lock the global heap shard*/
+		superblock = search_sizeclass(&(globalHeap->classes[class]));
+		freeBlock *block = superblock ? take_block(&(globalHeap->classes[class]), superblock) : NULL;
+		if(block != NULL)
+		{
+			/*move the superblock to the CPU heap*/
+			move_superblock(superblock, globalHeap, heap, class);
+			/*unlock the heaps*/
+			lock_release(&(globalHeap->classes[class].lock));
+			lock_release(&(heap->classes[class].lock));	
+			return block;
+		}
+		lock_release(&(globalHeap->classes[class].lock));
+	}
+	
+	/*an empty superblock comes first, then a sibling's mostly empty one, and only then a new one*/
+	freeBlock *block = NULL;
+	if((superblock = add_superblock(heap, class, 0)) != NULL || (superblock = steal_superblock(heap, class)) != NULL || (superblock = add_superblock(heap, class, 1)) != NULL)
+		block = take_block(sc, superblock); /*a free block from the superblock, this also moves it to it's place*/
+	lock_release(&(sc->lock));
+	return block;
+}
+
 void * malloc (size_t sz)
 {
-	/*if this is the first malloc, initialize the heaps*/
-	if(!isInitialized)
+	void *p = malloc_block(sz);
+	/*Every sampleInterval bytes(on average) an allocation is accounted to the thread's tag.
+	An estimate per sample is much cheaper than a tag per block, the fast path only counts down*/
+	if((bytesUntilSample -= sz) < 0 && config.sampleInterval != 0)
+		sample_allocation(p);
+	return p;
+}
+
+/*The function frees the block, and preserves the invariant for the heap*/
+/*move superblocks of a locked class of a CPU heap to the global heap while it breaks the invariant for emptyFraction.
+Once it breaks superblocks are moved until the high watermark(the target fraction) is reached*/
+static void trim_sizeclass(memHeap *heap, int class, unsigned int nb, double emptyFraction)
+{
+	sizeClass *sc = &(heap->classes[class]);
+	if(sc->numOfBlocks > config.reserve*nb && breaks_invariant(sc, nb, emptyFraction))
+	{
+		memHeap *globalHeap = &globalPools[NEAREST_POOL(heap)]; /*release to the heap's own shard*/
+		lock_acquire(&(globalHeap->classes[class].lock));
+		do
+		{
+			superblockHeader *badSB = (sc->superblocks).tail; /*if the invariant is not kept, then there's a superblock that doesn't maintain it. The tail is the superblock with the least used blocks, and therefore can't maintain it*/	
+			if(badSB->countedBlocks != 0 || !recycle_superblock(sc, badSB)) /*an empty one goes to the empty superblocks pool instead*/
+				move_superblock(badSB, heap, globalHeap, class); /*move it to the global heap*/
+		} while(sc->numOfBlocks > config.reserve*nb && breaks_invariant(sc, nb, config.targetFraction));
+		lock_release(&(globalHeap->classes[class].lock));			
+	}
+}
+
+/*free n blocks of a superblock to it(not to the thread's cache), and preserve the invariant for the heap. More than one block is freed at once(see free_blocks)*/
+static void free_to_superblock(superblockHeader *sb, void **blocks, unsigned int n, int class)
+{
+	/*free the blocks without locking: mark them in the superblock's bitmap and update the superblock's counter.
+	The owning class folds the counter into its own statistics the next time it reconciles.
+	The superblock may move between heaps at any moment, so the heap read here is only a hint.
+	Once the blocks are pushed the superblock may be empty and formatted again, so its header is read before that*/
+	unsigned int nb = sb->numOfBlocks;
+	memHeap *heap = __atomic_load_n(&(sb->parentHeap), __ATOMIC_ACQUIRE);
+	sizeClass *sc = &(heap->classes[class]);
+	superblockHeader *owner = sb;
+	unsigned int left = n == 1 ? free_block(&owner, blocks[0]) : free_blocks(&owner, blocks, n);
+	if(owner != sb) /*the superblock was meshed into another one meanwhile, leave the checks to the next free*/
+		return;
+
+	/*The invariant is checked every CHECK_INTERVAL frees to the class, or when a superblock empties, so a heap can stay past the invariant by less than a quarter of a superblock*/
+	unsigned int pending = __atomic_add_fetch(&(sc->pendingFrees), n, __ATOMIC_RELAXED);
+	if(left != 0 && (IS_GLOBAL(heap) || IS_PRIVATE(heap) || pending < CHECK_INTERVAL(nb)))
+		return;
+	/*if someone else holds the lock they will see the pending frees*/
+	if(lock_try(&(sc->lock)))
+		return;
+	/*an emptied superblock may have been formatted for another class since*/
+	if(__atomic_load_n(&(sb->parentHeap), __ATOMIC_ACQUIRE) != heap || sb->class != class)
 	{
-		init();
-		isInitialized = 1;
+		lock_release(&(sc->lock));
+		return;
 	}
-	
-	/*handle allocations for "large" blocks, allocate the block directly from OS*/
-	if(sz > SIZE_THRESHOLD)
+	/*a superblock of the global heap(or a private heap, which keeps no invariant) that empties can be used by any class*/
+	if(IS_GLOBAL(heap) || IS_PRIVATE(heap))
+	{
+		reconcile_superblock(sc, sb);
+		if(sb->countedBlocks == 0)
+			recycle_superblock(sc, sb);
+		lock_release(&(sc->lock));
+		return;
+	}
+	reconcile_sizeclass(sc);
+
+	/*preserve the invariant if the heap isn't the global heap.
+	The invariant is checked against the low watermark(F), but once it breaks superblocks are moved until the high watermark(the target fraction) is reached.
+	The gap between them, together with the reserve, stops a superblock from bouncing between the heaps on every malloc/free pair*/
+	trim_sizeclass(heap, class, nb, config.emptyFraction);
+	lock_release(&(sc->lock));
+	if(MESHING_ENABLED && config.meshInterval != 0 && !__atomic_load_n(&(background.running), __ATOMIC_RELAXED))
+		mesh_if_due();
+}
+
+/*give the blocks in the thread's cache back to their superblocks*/
+static void flush_tcache()
+{
+	int class;
+	for(class=0; class<NUM_OF_CLASSES; class++)
 	{
-		blockHeader *p = (blockHeader *)fetch_memory(sz+sizeof(blockHeader));
-		if(!p)
+		while(tcache.heads[class] != NULL)
 		{
-			perror(NULL);
-			return NULL;
+			void *block = tcache.heads[class];
+			tcache.heads[class] = tcache.heads[class]->next;
+			free_to_superblock(PAGE_RECORD(page_lookup(block)), &block, 1, class);
 		}
-		p->blockSize = sz;
-		return (p+1);
-	}
-	
-	int class = (int) ceil(log2(sz)); /*the appropriate size class*/
-	memHeap *heap = &(heaps[HASH(pthread_self())]);
-	pthread_mutex_lock(&(heap->classes[class].lock)); /*lock the heap*/
-	blockHeader *block = search_sizeclass(&(heap->classes[class])); /*search for a free block in the class*/
-	if(block != NULL)
-	{
-		superblockHeader *superblock = block->parentSuperblock;
-		blockList *list = &(superblock->freeList);
-		/*remove the block from the free list(it's the head of the list)*/
-		list->head = (list->head)->next;
-		/*update the block's, superblock's and size class' statistics*/
-		block -> inUse = 1;
-		superblock->usedBlocks++;
-		(heap->classes[class]).usedBlocks++;
-		/*move the superblock to it's new correct position in the size class*/
-		while(superblock->prev!=NULL && superblock->usedBlocks > (superblock->prev)->usedBlocks)
-		{
-			swap_superblocks(&((heap->classes[class]).superblocks),superblock->prev);
-		}
-		pthread_mutex_unlock(&(heap->classes[class].lock)); /*unlock the heap*/
-		return (block + 1);
-	}
-	
-	/*try to fetch a superblock from the global heap*/
-	memHeap *globalHeap = &(heaps[NUM_OF_CPUS]);
-	pthread_mutex_lock(&(globalHeap->classes[class].lock)); /*lock the global heap*/
-	superblockHeader *superblock = (globalHeap->classes[class]).superblocks.head;
-	if(superblock !=NULL) /*a superblock in the global heap must have empty space*/
-	{
-		blockList *list = &(superblock->freeList);
-		blockHeader *block = list->head; 	/*a free block from the superblock*/
-		list->head = (list->head)->next;	/*remove the block from the free list(it's the head of the list)*/	
-		/*update the block's, superblock's and size class' statistics*/
-		block -> inUse = 1;
-		superblock->usedBlocks++;
-		(globalHeap->classes[class]).usedBlocks++;
-		/*move the superblock to the CPU heap*/
-		move_superblock(superblock, globalHeap, heap, class);
-		/*unlock the heaps*/
-		pthread_mutex_unlock(&(globalHeap->classes[class].lock));
-		pthread_mutex_unlock(&(heap->classes[class].lock));	
-		return (block + 1);
+		tcache.counts[class] = 0;
 	}
-	
-	/*allocate a new superblock from OS*/
-	superblock = (superblockHeader *)fetch_memory(SUPERBLOCK_SIZE);
-	init_superblock(superblock, class);
-	if(superblock !=NULL)
-	{
-		superblock->parentHeap = heap;
-		blockList *list = &(superblock->freeList);
-		blockHeader *block = list->head; 	/*a free block from the superblock*/
-		list->head = (list->head)->next;	/*remove the block from the free list*/
-		/*update the block's, superblock's and size class' statistics*/
-		block -> inUse = 1;
-		superblock->usedBlocks++;
+}
+
+/*The thread is exiting: its cached blocks go back to their superblocks, and the space it leaves in its heap to the other threads.
+A heap dedicated to the thread gives up every superblock with a free block, a shared heap is brought back to the target fraction.
+If a later thread key destructor frees blocks to the cache again, the thread registers again and this runs once more*/
+static void thread_exit(void *unused)
+{
+	int class;
+	threadRegistered = 0;
+	flush_tcache();
+	memHeap *heap = thread_heap();
+	int dedicated = heap->id >= config.maxHeaps;
+	for(class=0; class<NUM_OF_CLASSES; class++)
+	{
 		sizeClass *sc = &(heap->classes[class]);
-		sc->usedBlocks++;
-		sc->numOfBlocks += superblock->numOfBlocks;
-		/*put the superblock in the sizeclass*/
-		superblock->parentHeap = heap;
-		if(sc->superblocks.tail != NULL)
-			(sc->superblocks.tail)->next = superblock;
+		superblockHeader *sb, *prev;
+		lock_acquire(&(sc->lock));
+		if(sc->superblocks.tail == NULL)
+		{
+			lock_release(&(sc->lock));
+			continue;
+		}
+		unsigned int nb = sc->superblocks.tail->numOfBlocks;
+		reconcile_sizeclass(sc);
+		if(!dedicated)
+			trim_sizeclass(heap, class, nb, config.targetFraction);
 		else
 		{
-			/*the size class is empty so this is also the first superblock*/
-			sc->superblocks.head = superblock;
+			memHeap *globalHeap = &globalPools[NEAREST_POOL(heap)];
+			lock_acquire(&(globalHeap->classes[class].lock));
+			for(sb = sc->superblocks.tail; sb != NULL && sb->countedBlocks < sb->numOfBlocks; sb = prev)
+			{
+				prev = sb->prev;
+				if(sb->countedBlocks != 0 || !recycle_superblock(sc, sb))
+					move_superblock(sb, heap, globalHeap, class);
+			}
+			lock_release(&(globalHeap->classes[class].lock));
 		}
-		superblock->prev = sc->superblocks.tail;
-		sc->superblocks.tail = superblock;
-		superblock->next = NULL;
-		/*move it to it's place*/
-		while(superblock->prev!=NULL && superblock->usedBlocks > (superblock->prev)->usedBlocks)
+		lock_release(&(sc->lock));
+	}
+}
+
+/*fault in the pages of empty superblocks until the pool's warm list holds the prefault reserve,
+so the next superblocks the classes format don't page fault a page at a time. Purged superblocks of the cold list are used first, new slots only once it's empty*/
+static void prefault_superblocks()
+{
+	/*the locked pool's superblocks are faulted in already, and more would come from the OS*/
+	if(config.lockedBytes != 0)
+		return;
+	while(1)
+	{
+		superblockHeader *sb = NULL;
+		pthread_mutex_lock(&(emptySuperblocks.lock));
+		int missing = emptySuperblocks.numOfWarm < config.prefault;
+		/*a purged superblock is faulted in again before a new slot is opened, or the cold list would grow with every decay*/
+		if(missing && (sb = emptySuperblocks.cold.head) != NULL)
+			unlink_superblock(&(emptySuperblocks.cold), sb);
+		pthread_mutex_unlock(&(emptySuperblocks.lock));
+		if(missing && sb == NULL)
+			sb = fetch_superblock();
+		if(sb == NULL)
+			return;
+#ifdef MADV_POPULATE_WRITE
+		if(madvise(DATA_OF(sb), SUPERBLOCK_SIZE, MADV_POPULATE_WRITE))
+#endif
 		{
-			swap_superblocks(&(sc->superblocks),superblock->prev);
+			/*the kernel can't populate the pages, touching them does the same. The slot's pages read as zeros either way*/
+			char *p;
+			for(p = DATA_OF(sb); p < DATA_OF(sb) + SUPERBLOCK_SIZE; p += PAGE_SIZE)
+				*(volatile char *)p = 0;
 		}
-		pthread_mutex_unlock(&(heap->classes[class].lock));
-		pthread_mutex_unlock(&(globalHeap->classes[class].lock));
-		return (block + 1);
+		pthread_mutex_lock(&(emptySuperblocks.lock));
+		sb->emptySince = now_ms();
+		push_superblock(&(emptySuperblocks.warm), sb);
+		emptySuperblocks.numOfWarm++;
+		pthread_mutex_unlock(&(emptySuperblocks.lock));
 	}
-	perror(NULL);
-	return NULL;
 }
 
-/*The function frees the block, and preserves the invariant for the heap*/
-void free (void * ptr) 
+/*One pass of the background thread: the CPU heaps that stopped freeing are brought back to the invariant, empty superblocks of the global heap go to the pool,
+the pool's superblocks that passed the decay time are purged, the prefault reserve is refilled and a mesh pass is made if it's due.
+A class whose lock is busy is left to the next pass*/
+static void background_pass()
 {
-	if (ptr != NULL)
-        {
-		blockHeader *block = (blockHeader *)(ptr) - 1;
-		if(block->blockSize > SUPERBLOCK_SIZE/2)
+	int i, class;
+	for(i=0; i<MAX_OF_CPUS; i++)
+	{
+		for(class=0; class<NUM_OF_CLASSES; class++)
 		{
-			/*the block was directly allocated from OS*/
-			if(munmap(block, block->blockSize + sizeof(blockHeader)))
-				perror(NULL);
+			sizeClass *sc = &(heaps[i].classes[class]);
+			if(__atomic_load_n(&(sc->superblocks.tail), __ATOMIC_RELAXED) == NULL || lock_try(&(sc->lock)))
+				continue;
+			if(sc->superblocks.tail != NULL)
+			{
+				unsigned int nb = sc->superblocks.tail->numOfBlocks;
+				reconcile_sizeclass(sc);
+				trim_sizeclass(&heaps[i], class, nb, config.emptyFraction);
+			}
+			lock_release(&(sc->lock));
 		}
-		else
+	}
+	for(i=0; i<config.numOfPools; i++)
+	{
+		for(class=0; class<NUM_OF_CLASSES; class++)
 		{
-			superblockHeader *sb = block->parentSuperblock;
-			int class = log2(block->blockSize);
-			memHeap *heap = sb->parentHeap;
-			sizeClass *sc = &(heap->classes[class]);
-			/*in order to lock the heap we need to lock the superblock first, or it could be moved*/
-			pthread_mutex_lock(&(sb->lock));
-			pthread_mutex_lock(&(sc->lock));
-			pthread_mutex_unlock(&(sb->lock));
-
-			/*free the block*/
-			block->inUse = 0;
-			block->next = sb->freeList.head;
-			sb->freeList.head = block;
-
-			/*update statistics*/
-			sb->usedBlocks--;
-			sc->usedBlocks--;
-
-			/*move the superblock to it's appropriate location in the size class*/
-			while(sb->next != NULL && sb->usedBlocks < (sb->next)->usedBlocks)
+			sizeClass *sc = &(globalPools[i].classes[class]);
+			superblockHeader *sb, *next;
+			if(__atomic_load_n(&(sc->superblocks.tail), __ATOMIC_RELAXED) == NULL || lock_try(&(sc->lock)))
+				continue;
+			reconcile_sizeclass(sc);
+			for(sb = sc->superblocks.head; sb != NULL; sb = next)
 			{
-				swap_superblocks(&(sc->superblocks),sb); 
+				next = sb->next;
+				if(sb->countedBlocks == 0)
+					recycle_superblock(sc, sb);
 			}
+			lock_release(&(sc->lock));
+		}
+	}
+	pthread_mutex_lock(&(emptySuperblocks.lock));
+	purge_empty_superblocks(now_ms());
+	pthread_mutex_unlock(&(emptySuperblocks.lock));
+	prefault_superblocks();
+	if(MESHING_ENABLED && config.meshInterval != 0)
+		mesh_if_due();
+	background.passes++;
+}
+
+/*the background thread: a pass every backgroundInterval ms, or sooner when a malloc takes the prefaulted reserve(see request_background_pass)*/
+static void * background_main(void *unused)
+{
+	struct timespec interval = {config.backgroundInterval / 1000, (config.backgroundInterval % 1000) * 1000000L};
+	while(1)
+	{
+		syscall(SYS_futex, &(background.requested), FUTEX_WAIT_PRIVATE, 0, &interval, NULL, 0);
+		__atomic_store_n(&(background.requested), 0, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&(background.passLock));
+		background_pass();
+		pthread_mutex_unlock(&(background.passLock));
+	}
+	return NULL;
+}
+
+/*Create the background thread. It's created by the first malloc that locks a heap, with no lock held(pthread_create allocates,
+so it can't be called from init()). The allocations pthread_create makes find the thread started and go on as usual*/
+static void start_background()
+{
+	int started = 0;
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t blocked, old;
+	if(!__atomic_compare_exchange_n(&(background.started), &started, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	/*signals go to the program's threads, only the faults the thread itself may cause are left unblocked*/
+	sigfillset(&blocked);
+	sigdelset(&blocked, SIGSEGV);
+	sigdelset(&blocked, SIGBUS);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_sigmask(SIG_SETMASK, &blocked, &old);
+	if(pthread_create(&thread, &attr, background_main, NULL))
+		fprintf(stderr, "mtmm: can't start the background thread\n");
+	else
+		__atomic_store_n(&(background.running), 1, __ATOMIC_RELEASE);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+/*a fork waits for a pass that's under way, so the child doesn't inherit the class and pool locks the thread held.
+The prepare handlers run in reverse order, so this is taken before the mesh pass lock, as the pass does*/
+static void background_atfork_prepare()
+{
+	pthread_mutex_lock(&(background.passLock));
+}
+
+static void background_atfork_parent()
+{
+	pthread_mutex_unlock(&(background.passLock));
+}
 
-			memHeap *globalHeap = &(heaps[NUM_OF_CPUS]);
+/*a forked child has no background thread, the hot paths do the housekeeping until its first malloc starts one*/
+static void background_atfork_child()
+{
+	background.started = 0;
+	background.running = 0;
+	background.requested = 0;
+	pthread_mutex_unlock(&(background.passLock));
+}
 
-			/*preserve the invariant if the heap isn't the global heap*/
-			if(heap != globalHeap && sc->usedBlocks < (sc->numOfBlocks - K*sb->numOfBlocks) && (float) (sc->usedBlocks) < (1-F)*(sc->numOfBlocks))
+void free (void * ptr) 
+{
+	if (ptr != NULL)
+        {
+		unsigned long entry = lookup_block(ptr);
+		if(entry == 0)
+			fprintf(stderr, "mtmm: free(): invalid pointer %p\n", ptr);
+		else if(PAGE_KIND(entry) != PAGE_SUPERBLOCK)
+			free_large(entry);
+		else
+		{
+			freeBlock *block = ptr;
+			superblockHeader *sb = PAGE_RECORD(entry);
+			int class = sb->class;
+			if(__atomic_load_n(&(sb->samples), __ATOMIC_RELAXED) != 0 && unsample_block(block))
+				__atomic_sub_fetch(&(sb->samples), 1, __ATOMIC_RELAXED);
+			/*keep the block in the thread's cache if there's room, it stays "used" in its superblock.
+			A private heap's blocks aren't cached, the cache could hand them to malloc and they'd be gone with the heap*/
+			if(tcache.counts[class] < config.tcacheSize && !IS_PRIVATE(__atomic_load_n(&(sb->parentHeap), __ATOMIC_RELAXED)))
 			{
-				pthread_mutex_lock(&(globalHeap->classes[class].lock));
-				superblockHeader *badSB = (sc->superblocks).tail; /*if the invariant is not kept, then there's a superblock that doesn't maintain it. The tail is the superblock with the least used blocks, and therefore can't maintain it*/	
-				move_superblock(badSB, heap, globalHeap, class); /*move it to the global heap*/
-				pthread_mutex_unlock(&(globalHeap->classes[class].lock));			
+				register_thread();
+				block->next = tcache.heads[class];
+				tcache.heads[class] = block;
+				tcache.counts[class]++;
+				return;
 			}
-			pthread_mutex_unlock(&(sc->lock));
+			free_to_superblock(sb, &ptr, 1, class);
 		}
 	}	
 }
 
+void mtmm_get_stats(mtmmStats *stats)
+{
+	int i, j;
+	ensure_init();
+	memset(stats, 0, sizeof(*stats));
+	for(i=0; i<MAX_OF_CPUS; i++)
+	{
+		for(j=0; j<NUM_OF_CLASSES; j++)
+		{
+			stats->transfersToGlobal += heaps[i].classes[j].transfersOut;
+			stats->transfersFromGlobal += heaps[i].classes[j].transfersIn;
+			stats->stolenSuperblocks += heaps[i].classes[j].steals;
+		}
+	}
+	stats->heaps = __atomic_load_n(&activeHeaps, __ATOMIC_RELAXED);
+	stats->meshedSuperblocks = meshSpace.meshedSuperblocks;
+	stats->reusedSuperblocks = emptySuperblocks.reused;
+	stats->backgroundPasses = background.passes;
+	stats->lockedSuperblocks = lockedSlots;
+	stats->lockedExhaustions = __atomic_load_n(&lockedExhaustions, __ATOMIC_RELAXED);
+	stats->droppedSamples = __atomic_load_n(&droppedSamples, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&(sbRegion.lock));
+	stats->superblockSlots = sbRegion.nextSlot;
+	pthread_mutex_unlock(&(sbRegion.lock));
+}
+
+/*take a free record, or add a new one to the records list. Without memory for one the shared record is returned*/
+static epochRecord * acquire_epoch_record()
+{
+	epochRecord *record;
+	for(record = __atomic_load_n(&epochRecords, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+	{
+		int free = 0;
+		if(__atomic_compare_exchange_n(&(record->inUse), &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if(record == NULL)
+	{
+		record = malloc(sizeof(epochRecord));
+		if(record == NULL)
+		{
+			fprintf(stderr, "mtmm: can't allocate an epoch record, the thread uses the shared one\n");
+			return &sharedEpoch;
+		}
+		memset(record, 0, sizeof(epochRecord));
+		record->inUse = 1;
+		record->next = __atomic_load_n(&epochRecords, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&epochRecords, &(record->next), record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(epochKey, record);
+	return record;
+}
+
+/*the thread's record, taken on first use*/
+static inline epochRecord * thread_epoch_record()
+{
+	ensure_init();
+	if(threadEpoch == NULL)
+		threadEpoch = acquire_epoch_record();
+	return threadEpoch;
+}
+
+/*advance the global epoch if every thread inside a critical section has seen the current one. Returns the global epoch*/
+static unsigned long try_advance_epoch()
+{
+	unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+	epochRecord *record;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for(record = __atomic_load_n(&epochRecords, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+	{
+		unsigned long seen = __atomic_load_n(&(record->epoch), __ATOMIC_ACQUIRE);
+		if(seen != 0 && seen != epoch)
+			return epoch;
+	}
+	/*another thread may have advanced it already, either way it's past epoch now*/
+	__atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+}
+
+/*free the blocks of a retired batch. The blocks of each superblock are freed to it at once, other blocks are freed one by one.
+They don't go to the thread's cache, which would free them one by one later*/
+static void reclaim_batch(retiredBatch *batch)
+{
+	unsigned long keys[RETIRE_GROUPS] = {0};	/*the page map entries of the superblocks, by hash*/
+	unsigned int first[RETIRE_GROUPS], last[RETIRE_GROUPS], link[RETIRE_BATCH], slots[RETIRE_BATCH];
+	void *group[RETIRE_BATCH];
+	unsigned int i, j, n;
+	/*link the blocks of each superblock in the order they were retired*/
+	for(i=0; i<batch->count; i++)
+	{
+		unsigned long entry = lookup_block(batch->blocks[i]);
+		if(entry == 0 || PAGE_KIND(entry) != PAGE_SUPERBLOCK)
+		{
+			free(batch->blocks[i]); /*frees a larger block, or reports an invalid pointer*/
+			slots[i] = RETIRE_GROUPS;
+			continue;
+		}
+		unsigned int h = (entry / CACHE_LINE) % RETIRE_GROUPS; /*the headers are a cache line apart*/
+		while(keys[h] != 0 && keys[h] != entry)
+			h = (h + 1) % RETIRE_GROUPS;
+		if(keys[h] == 0)
+		{
+			keys[h] = entry;
+			first[h] = i;
+		}
+		else
+			link[last[h]] = i;
+		last[h] = i;
+		link[i] = RETIRE_BATCH;
+		slots[i] = h;
+	}
+	/*free each superblock's blocks when its first block comes up*/
+	for(i=0; i<batch->count; i++)
+	{
+		if(slots[i] == RETIRE_GROUPS || first[slots[i]] != i)
+			continue;
+		superblockHeader *sb = PAGE_RECORD(keys[slots[i]]);
+		for(n=0, j=i; j != RETIRE_BATCH; j = link[j])
+		{
+			if(__atomic_load_n(&(sb->samples), __ATOMIC_RELAXED) != 0 && unsample_block(batch->blocks[j]))
+				__atomic_sub_fetch(&(sb->samples), 1, __ATOMIC_RELAXED);
+			group[n++] = batch->blocks[j];
+		}
+		free_to_superblock(sb, group, n, sb->class);
+	}
+}
+
+/*free the limbo lists of a record that were retired at least 2 epochs before the given one.
+No thread can still be inside a critical section that started before they were retired*/
+static void reclaim_limbo(epochRecord *record, unsigned long epoch)
+{
+	int i;
+	for(i=0; i<LIMBO_LISTS; i++)
+	{
+		if(record->limbo[i] == NULL || record->limboEpoch[i] + 2 > epoch)
+			continue;
+		retiredBatch *batch = record->limbo[i];
+		record->limbo[i] = NULL;
+		while(batch != NULL)
+		{
+			retiredBatch *next = batch->next;
+			reclaim_batch(batch);
+			free(batch);
+			batch = next;
+		}
+	}
+}
+
+/*the thread exited, its retired blocks stay in the record until the record's next owner reclaims them*/
+static void release_epoch_record(void *record)
+{
+	epochRecord *r = record;
+	__atomic_store_n(&(r->epoch), 0, __ATOMIC_RELEASE);
+	r->depth = 0;
+	reclaim_limbo(r, try_advance_epoch());
+	threadEpoch = NULL;
+	__atomic_store_n(&(r->inUse), 0, __ATOMIC_RELEASE);
+}
+
+/*The shared record's depth counts the critical sections of all its threads, and it announces the epoch the first of them entered in.
+That holds the epoch back until they all leave, which is safe, only slower to reclaim*/
+void mtmm_epoch_enter()
+{
+	epochRecord *record = thread_epoch_record();
+	if(record == &sharedEpoch)
+		pthread_mutex_lock(&sharedEpochLock);
+	if(record->depth++ == 0)
+	{
+		__atomic_store_n(&(record->epoch), __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+		/*the announcement must be visible before the thread reads anything shared*/
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+	if(record == &sharedEpoch)
+		pthread_mutex_unlock(&sharedEpochLock);
+}
+
+void mtmm_epoch_exit()
+{
+	epochRecord *record = threadEpoch;
+	if(record == &sharedEpoch)
+		pthread_mutex_lock(&sharedEpochLock);
+	if(record != NULL && record->depth > 0 && --record->depth == 0)
+		__atomic_store_n(&(record->epoch), 0, __ATOMIC_RELEASE);
+	if(record == &sharedEpoch)
+		pthread_mutex_unlock(&sharedEpochLock);
+}
+
+/*add a block to a record's limbo list of the current epoch, and reclaim the lists that are old enough*/
+static void retire_block(epochRecord *record, void *ptr)
+{
+	unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+	int i = epoch % LIMBO_LISTS;
+	/*the list of this epoch's slot is from LIMBO_LISTS epochs ago or older, so it's safe to free*/
+	if(record->limbo[i] != NULL && record->limboEpoch[i] != epoch)
+		reclaim_limbo(record, epoch);
+	retiredBatch *batch = record->limbo[i];
+	if(batch == NULL || batch->count == RETIRE_BATCH)
+	{
+		batch = malloc(sizeof(retiredBatch));
+		if(batch == NULL)
+		{
+			perror(NULL);
+			return; /*the block leaks, freeing it now isn't safe*/
+		}
+		batch->count = 0;
+		batch->next = record->limbo[i];
+		record->limbo[i] = batch;
+	}
+	batch->blocks[batch->count++] = ptr;
+	record->limboEpoch[i] = epoch;
+	if(++record->pending >= RETIRE_BATCH)
+	{
+		record->pending = 0;
+		reclaim_limbo(record, try_advance_epoch());
+	}
+}
+
+void mtmm_retire(void *ptr)
+{
+	if(ptr == NULL)
+		return;
+	epochRecord *record = thread_epoch_record();
+	if(record == &sharedEpoch)
+	{
+		pthread_mutex_lock(&sharedEpochLock);
+		retire_block(record, ptr);
+		pthread_mutex_unlock(&sharedEpochLock);
+	}
+	else
+		retire_block(record, ptr);
+}
+
+mtmm_heap_t * mtmm_heap_create(const mtmmHeapOptions *options)
+{
+	int i;
+	ensure_init();
+	mtmm_heap_t *heap = malloc(sizeof(mtmm_heap_t));
+	if(heap == NULL)
+		return NULL;
+	memset(heap, 0, sizeof(mtmm_heap_t));
+	heap->heap.isPrivate = 1;
+	for(i=0; i<NUM_OF_CLASSES; i++)
+	{
+		heap->heap.classes[i].size = SIZE_OF_CLASS(i);
+	}
+	pthread_mutex_init(&(heap->lock), NULL);
+	if(options != NULL)
+		heap->limit = options->limit;
+	return heap;
+}
+
+void * mtmm_heap_malloc(mtmm_heap_t *heap, size_t sz)
+{
+	if(sz > config.sizeThreshold)
+	{
+		void *p = sz <= MEDIUM_MAX_SIZE ? medium_malloc(sz) : large_malloc(sz);
+		if(p == NULL)
+			return NULL;
+		pthread_mutex_lock(&(heap->lock));
+		if(sz <= MEDIUM_MAX_SIZE)
+		{
+			runHeader *run = (runHeader *)p - 1;
+			run->heap = heap;
+			run->prev = NULL;
+			run->next = heap->runs;
+			if(heap->runs != NULL)
+				heap->runs->prev = run;
+			heap->runs = run;
+		}
+		else
+		{
+			largeHeader *large = (largeHeader *)p - 1;
+			large->heap = heap;
+			large->prev = NULL;
+			large->next = heap->largeBlocks;
+			if(heap->largeBlocks != NULL)
+				heap->largeBlocks->prev = large;
+			heap->largeBlocks = large;
+		}
+		pthread_mutex_unlock(&(heap->lock));
+		size_t size = __atomic_add_fetch(&(heap->size), sz <= MEDIUM_MAX_SIZE ? ((runHeader *)p - 1)->pages*PAGE_SIZE : ((largeHeader *)p - 1)->size, __ATOMIC_RELAXED);
+		int over = heap->limit != 0 && size > heap->limit;
+		if(over)
+		{
+			free_large(page_lookup(p));
+			errno = ENOMEM;
+			return NULL;
+		}
+		return p;
+	}
+
+	int class = sz <= MIN_BLOCK_SIZE ? MIN_CLASS : (int) ceil(log2(sz));
+	sizeClass *sc = &(heap->heap.classes[class]);
+	freeBlock *block = NULL;
+	superblockHeader *superblock;
+	lock_acquire(&(sc->lock));
+	while(block == NULL && (superblock = search_sizeclass(sc)) != NULL)
+	{
+		block = take_block(sc, superblock);
+		if(block == NULL)
+			reconcile_sizeclass(sc); /*the counters were stale, fix them before searching again*/
+	}
+	if(block == NULL && (superblock = add_superblock(&(heap->heap), class, 1)) != NULL)
+		block = take_block(sc, superblock);
+	lock_release(&(sc->lock));
+	return block;
+}
+
+void mtmm_heap_free(mtmm_heap_t *heap, void *ptr)
+{
+	if(ptr == NULL)
+		return;
+	unsigned long entry = lookup_block(ptr);
+	mtmm_heap_t *owner = NULL;
+	if(PAGE_KIND(entry) == PAGE_SUPERBLOCK)
+	{
+		memHeap *parent = __atomic_load_n(&(((superblockHeader *)PAGE_RECORD(entry))->parentHeap), __ATOMIC_ACQUIRE);
+		owner = parent != NULL && IS_PRIVATE(parent) ? (mtmm_heap_t *)parent : NULL;
+	}
+	else if(PAGE_KIND(entry) == PAGE_RUN)
+		owner = ((runHeader *)PAGE_RECORD(entry))->heap;
+	else if(PAGE_KIND(entry) == PAGE_LARGE)
+		owner = ((largeHeader *)PAGE_RECORD(entry))->heap;
+	if(owner != heap)
+	{
+		fprintf(stderr, "mtmm: mtmm_heap_free(): invalid pointer %p\n", ptr);
+		return;
+	}
+	free(ptr);
+}
+
+void mtmm_heap_destroy(mtmm_heap_t *heap)
+{
+	int i;
+	if(heap == NULL)
+		return;
+	/*the superblocks' live blocks die with the heap*/
+	for(i=0; i<NUM_OF_CLASSES; i++)
+	{
+		pool_superblocks(&(heap->heap.classes[i].superblocks));
+	}
+	while(heap->runs != NULL)
+	{
+		runHeader *run = heap->runs;
+		heap->runs = run->next;
+		medium_free(run);
+	}
+	while(heap->largeBlocks != NULL)
+	{
+		largeHeader *large = heap->largeBlocks;
+		heap->largeBlocks = large->next;
+		large_free(large);
+	}
+	pthread_mutex_destroy(&(heap->lock));
+	free(heap);
+}
+
+/*unbind the thread from its heap, giving the heap back if it was dedicated to the thread*/
+static void release_bound_heap(void *heap)
+{
+	memHeap *h = heap != NULL ? heap : boundHeap;
+	if(h == NULL)
+		return;
+	__atomic_sub_fetch(&(h->boundThreads), 1, __ATOMIC_RELAXED);
+	pthread_setspecific(heapKey, NULL);
+	if(h->id >= config.maxHeaps)
+		__atomic_and_fetch(&dedicatedHeaps, ~(1UL << h->id), __ATOMIC_RELEASE);
+	boundHeap = NULL;
+}
+
+int mtmm_thread_bind_heap(int id)
+{
+	ensure_init();
+	if(id < -1 || id >= (int)config.maxHeaps)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	release_bound_heap(NULL);
+	if(id != -1)
+	{
+		boundHeap = &heaps[id];
+		__atomic_add_fetch(&(boundHeap->boundThreads), 1, __ATOMIC_RELAXED);
+		pthread_setspecific(heapKey, boundHeap);
+	}
+	return 0;
+}
+
+int mtmm_thread_private_heap()
+{
+	unsigned int id;
+	ensure_init();
+	if(boundHeap != NULL && boundHeap->id >= config.maxHeaps)
+		return boundHeap->id;
+	/*the heaps past maxHeaps are never chosen by hashing, so a thread that takes one has it to itself.
+	Whatever a previous owner left in it is reused*/
+	unsigned long taken = __atomic_load_n(&dedicatedHeaps, __ATOMIC_ACQUIRE);
+	do
+	{
+		for(id=config.maxHeaps; id<MAX_OF_CPUS && (taken & (1UL << id)); id++);
+		if(id == MAX_OF_CPUS)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+	} while(!__atomic_compare_exchange_n(&dedicatedHeaps, &taken, taken | (1UL << id), 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	release_bound_heap(NULL);
+	boundHeap = &heaps[id];
+	__atomic_add_fetch(&(boundHeap->boundThreads), 1, __ATOMIC_RELAXED);
+	pthread_setspecific(heapKey, boundHeap);
+	return id;
+}
+
+int mtmm_get_heap_stats(unsigned int id, mtmmHeapStats *stats)
+{
+	int j;
+	ensure_init();
+	if(id >= MAX_OF_CPUS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	for(j=0; j<NUM_OF_CLASSES; j++)
+	{
+		sizeClass *sc = &(heaps[id].classes[j]);
+		superblockHeader *sb;
+		lock_acquire(&(sc->lock));
+		reconcile_sizeclass(sc);
+		stats->usedBytes += (unsigned long)sc->usedBlocks * sc->size;
+		stats->heldBytes += (unsigned long)sc->numOfBlocks * sc->size;
+		for(sb = sc->superblocks.head; sb != NULL; sb = sb->next)
+			stats->superblocks++;
+		stats->transfersToGlobal += sc->transfersOut;
+		stats->transfersFromGlobal += sc->transfersIn;
+		lock_release(&(sc->lock));
+	}
+	stats->boundThreads = __atomic_load_n(&(heaps[id].boundThreads), __ATOMIC_RELAXED);
+	return 0;
+}
+
+mtmm_arena_t * mtmm_arena_begin()
+{
+	mtmm_arena_t *arena = malloc(sizeof(mtmm_arena_t));
+	if(arena != NULL)
+		memset(arena, 0, sizeof(mtmm_arena_t));
+	return arena;
+}
+
+void * mtmm_arena_alloc(mtmm_arena_t *arena, size_t sz)
+{
+	/*a block that would waste most of a superblock is allocated by malloc, and freed by the reset.
+	The size is checked before it's rounded, rounding a huge one up would wrap around*/
+	if(sz > config.sizeThreshold)
+	{
+		arenaBlock *record = mtmm_arena_alloc(arena, sizeof(arenaBlock));
+		if(record == NULL || (record->block = malloc(sz)) == NULL)
+			return NULL;
+		record->next = arena->blocks;
+		arena->blocks = record;
+		return record->block;
+	}
+	/*an empty block takes room too, so it has its own address, and a new arena's NULL cursor is never returned*/
+	sz = sz == 0 ? ARENA_ALIGNMENT : (sz + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	if(arena->end - arena->cursor < (long)sz)
+	{
+		/*The superblock comes from the same supply malloc uses, and isn't formatted for any class.
+		Its addresses are taken out of the page map, so free() reports the arena's memory instead of corrupting it*/
+		ensure_init();
+		superblockHeader *sb = reuse_superblock();
+		if(sb == NULL)
+			sb = fetch_superblock();
+		if(sb == NULL || page_map_set(DATA_OF(sb), SUPERBLOCK_SIZE, 0))
+		{
+			perror(NULL);
+			return NULL;
+		}
+		sb->parentHeap = NULL;
+		push_superblock(&(arena->superblocks), sb);
+		arena->cursor = (char *)DATA_OF(sb);
+		arena->end = arena->cursor + SUPERBLOCK_SIZE;
+	}
+	void *p = arena->cursor;
+	arena->cursor += sz;
+	return p;
+}
+
+void mtmm_arena_reset(mtmm_arena_t *arena)
+{
+	arenaBlock *record;
+	/*the records live in the arena's superblocks, so the blocks go first*/
+	for(record = arena->blocks; record != NULL; record = record->next)
+		free(record->block);
+	arena->blocks = NULL;
+	if(arena->superblocks.head != NULL)
+		pool_superblocks(&(arena->superblocks));
+	arena->cursor = arena->end = NULL;
+}
+
+void mtmm_arena_end(mtmm_arena_t *arena)
+{
+	if(arena == NULL)
+		return;
+	mtmm_arena_reset(arena);
+	free(arena);
+}
+
+void mtmm_set_tag(unsigned int tag)
+{
+	if(tag >= MTMM_MAX_TAGS)
+	{
+		fprintf(stderr, "mtmm: mtmm_set_tag(): bad tag %u\n", tag);
+		return;
+	}
+	currentTag = tag;
+}
+
+unsigned int mtmm_get_tag()
+{
+	return currentTag;
+}
+
+size_t mtmm_tag_bytes(unsigned int tag)
+{
+	int i;
+	long bytes = 0;
+	if(tag >= MTMM_MAX_TAGS)
+		return 0;
+	for(i=0; i<MAX_OF_CPUS; i++)
+		bytes += __atomic_load_n(&(tagBytes[i][tag]), __ATOMIC_RELAXED);
+	return bytes > 0 ? bytes : 0;
+}
+
 /*calloc is implemented because of a problem with linux-scalability(it used calloc which called the default malloc)*/
 void *calloc(size_t num, size_t sz)
 {
@@ -399,12 +2992,40 @@ void *calloc(size_t num, size_t sz)
 }
 
 
+size_t malloc_usable_size(void *ptr)
+{
+	unsigned long entry = ptr ? lookup_block(ptr) : 0;
+	if(PAGE_KIND(entry) == PAGE_SUPERBLOCK)
+		return SIZE_OF_CLASS(((superblockHeader *)PAGE_RECORD(entry))->class);
+	if(PAGE_KIND(entry) == PAGE_RUN)
+		return ((runHeader *)PAGE_RECORD(entry))->pages*PAGE_SIZE - sizeof(runHeader);
+	if(PAGE_KIND(entry) == PAGE_LARGE)
+		return ((largeHeader *)PAGE_RECORD(entry))->blockSize;
+	return 0;
+}
+
 void * realloc (void * ptr, size_t sz) 
 {
+	if(ptr == NULL)
+		return malloc(sz);
+	if(sz == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	size_t oldSize = malloc_usable_size(ptr);
+	if(oldSize == 0)
+	{
+		fprintf(stderr, "mtmm: realloc(): invalid pointer %p\n", ptr);
+		return NULL;
+	}
+	/*keep the block if it's big enough, and not more than twice as big as needed*/
+	if(sz <= oldSize && sz > oldSize/2)
+		return ptr;
 	void *newPtr = malloc(sz);
 	if(newPtr != NULL)
 	{
-		memcpy(newPtr, ptr, sz);
+		memcpy(newPtr, ptr, sz < oldSize ? sz : oldSize);
 		free(ptr);
 	}
 	return newPtr;
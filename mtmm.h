@@ -7,6 +7,47 @@
 #define SUPERBLOCK_SIZE 65536
 
 
+/*
+
+Runtime tunables. The MTMM_CONF environment variable is read once, when the allocator initializes, as a
+comma separated list of key:value pairs, for example MTMM_CONF=f:0.25,heaps:8,tcache:32
+Unknown keys and bad values(negative, not a whole number where a count or a time is expected, or out of range) are reported on stderr and ignored.
+
+f		the empty fraction allowed in a heap before a superblock is moved to the global heap(0 <= f < 1)
+target		the empty fraction a heap is brought back to once it passes f(at most f, default f/2)
+reserve		the number of superblocks per size class a heap keeps regardless of f
+k		the number of superblocks worth of empty space a heap may keep regardless of f
+heaps		the number of CPU heaps threads are spread over at start(1-64)
+max_heaps	the number of CPU heaps they may be spread over when the heaps' locks are often busy(1-64, default 32).
+		The heaps past it can be dedicated to threads(see mtmm_thread_private_heap)
+pools		the number of independently locked shards of the global heap(1-16)
+threshold	allocations larger than this many bytes get whole pages instead of a superblock's block(at most SUPERBLOCK_SIZE/2)
+tcache		the number of freed blocks per size class a thread keeps for reuse(0 disables the cache)
+decay		the time in milliseconds an empty superblock is kept before its pages are returned to the OS
+mesh		1 to allocate superblocks from a memfd backed arena that allows meshing(see mtmm_mesh), 0 by default.
+		Meshing installs a SIGSEGV handler, a handler installed later must pass faults inside the arena back to it.
+		A superblock is write protected while it's meshed, and the kernel doesn't wait for it as threads do: a system call
+		that writes into one of its blocks meanwhile(read(2), recv(2), getdents(2)...) fails with EFAULT.
+		A program that hands heap buffers to such calls while passes may run must retry them on EFAULT.
+		fork() copies the arena's pages for the child, so a fork costs time and memory in proportion to the heap's superblocks,
+		fork+exec included(bench/mesh_rss.c measures it). posix_spawn() doesn't run fork handlers and doesn't pay it
+mesh_interval	the time in milliseconds between automatic mesh passes, 0 for on demand passes only(default 1000)
+sample		the average number of bytes a thread allocates between allocations sampled for tag accounting(see mtmm_set_tag),
+		0 disables the accounting(default 524288)
+background	the time in milliseconds between the passes of a background thread that returns the pages of decayed empty superblocks to the OS
+		and makes the due mesh passes instead of malloc() and free(), keeps empty superblocks prefaulted, and brings idle heaps
+		back to the invariant. 0 disables the thread(the default). It's started by the first malloc() that locks a heap
+prefault	the number of empty superblocks the background thread keeps with their pages faulted in for the next classes that need one.
+		A malloc() that takes one wakes the thread to replace it(default 4)
+locked		the bytes of superblocks reserved, faulted in and locked in memory(mlock) at start, with the allocator's own structures,
+		so malloc() of blocks up to the threshold tunable never faults or maps memory while they last. 0 disables it(the default).
+		Larger blocks get memory from the OS as usual, the exhausted policy doesn't apply to them. The allocator exits if the memory can't be locked(see RLIMIT_MEMLOCK).
+		Meshing is ignored with a locked pool, and a forked child doesn't inherit the memory locks
+exhausted	what malloc() does when it needs memory the locked pool doesn't have: 0 returns NULL with errno set to ENOMEM(the default),
+		1 takes it from the OS, unlocked, as without a locked pool, 2 aborts the process. Either way it's counted(see lockedExhaustions)
+*/
+
+
 /*
 
 The malloc() function allocates size bytes and returns a pointer to the allocated memory. 
@@ -15,7 +56,7 @@ pointer value that can later be successfully passed to free().
 
 
 malloc (sz)
-1. If sz > S/2, allocate the superblock from the OS and return it.
+1. If sz > S/2, carve a run of pages for it from a reserved span(or allocate it from the OS if it's bigger than a span allows) and return it.
 2. i ← hash(the current thread).
 3. Lock heap i.
 4. Scan heap i’s list of superblocks from most full to least (for the size class corresponding to sz).
@@ -41,13 +82,14 @@ void * malloc (size_t sz);
 
 The free() function frees the memory space pointed to by ptr, which must have been returned 
 by a previous call to malloc(), calloc() or realloc(). Otherwise, or if free(ptr) has already 
-been called before, undefined behavior occurs. If ptr is NULL, no operation is performed.
+been called before, undefined behavior occurs. If ptr is NULL, no operation is performed. 
+A pointer the allocator doesn't own(it isn't in the page map) is reported on stderr and ignored.
 
 
 free (ptr)
 1. If the block is “large”,
-2. Free the superblock to the operating system and return.
-3. Find the superblock s this block comes from and lock it.
+2. Return its run of pages to the span's free runs(or free it to the operating system) and return.
+3. Find the superblock s this block comes from(through the page map) and lock it.
 4. Lock heap i, the superblock’s owner.
 5. Deallocate the block from the superblock.
 6. u i ← u i − block size.
@@ -74,13 +116,176 @@ is equivalent to free(ptr). Unless ptr is NULL, it must have been returned by an
 call to malloc(), calloc() or realloc(). If the area pointed to was moved, a free(ptr) is done. 
 
 
-1. allocate sz bytes
-2. copy from old location to a new one
-3. free old allocation
+1. If the block already fits sz, and is at most twice as big, return it
+2. allocate sz bytes
+3. copy from old location to a new one(up to the smaller of the two sizes)
+4. free old allocation
 */
 void * realloc (void * ptr, size_t sz) ;
 
 
+/*
+
+The malloc_usable_size() function returns the number of usable bytes in the block pointed to by ptr, 
+a pointer to a block of memory allocated by malloc() or a related function. 
+It returns 0 if ptr is NULL or wasn't returned by the allocator.
+*/
+size_t malloc_usable_size (void * ptr) ;
+
+
+/*
+
+Allocator statistics. The counters are read without locking, so they are only a snapshot.
+
+transfersToGlobal	the number of superblocks moved from the CPU heaps to the global heap
+transfersFromGlobal	the number of superblocks moved from the global heap to the CPU heaps
+meshedSuperblocks	the number of superblocks whose pages were released by meshing
+reusedSuperblocks	the number of empty superblocks formatted again, possibly for another size class
+heaps			the number of CPU heaps threads are currently spread over
+stolenSuperblocks	the number of superblocks a CPU heap took from a sibling instead of mapping a new one
+backgroundPasses	the number of passes the background thread made(see the background tunable)
+lockedSuperblocks	the number of superblocks in the locked pool(see the locked tunable)
+lockedExhaustions	the number of allocations that needed a superblock the locked pool doesn't have
+droppedSamples		the number of sampled allocations left out of tag accounting because the table had no room for them(see mtmm_set_tag)
+superblockSlots		the number of slots of the superblocks region that were ever used. A slot's header and bitmap stay mapped for good
+*/
+typedef struct sMtmmStats
+{
+	unsigned long transfersToGlobal;
+	unsigned long transfersFromGlobal;
+	unsigned long meshedSuperblocks;
+	unsigned long reusedSuperblocks;
+	unsigned long heaps;
+	unsigned long stolenSuperblocks;
+	unsigned long backgroundPasses;
+	unsigned long lockedSuperblocks;
+	unsigned long lockedExhaustions;
+	unsigned long droppedSamples;
+	unsigned long superblockSlots;
+} mtmmStats;
+
+void mtmm_get_stats(mtmmStats *stats);
+
+
+/*
+
+Thread to heap affinity. A thread allocates from the CPU heap its id hashes to, unless it's bound to one.
+mtmm_thread_bind_heap() binds the calling thread to CPU heap id(0 to the max_heaps tunable-1), or back to hashing if id is -1,
+so background threads can share one heap. It returns 0, or -1 with errno set to EINVAL for a bad id.
+mtmm_thread_private_heap() binds the calling thread to a heap no other thread allocates from, one of the MTMM_MAX_HEAPS heaps
+past the max_heaps tunable, and returns its id. It returns -1 with errno set to EAGAIN if they are all taken.
+The heap is given back when the thread exits or binds to another heap, its blocks stay valid.
+Blocks are freed to the heap that owns their superblock whichever heap the freeing thread uses.
+
+mtmm_get_heap_stats() fills the statistics of CPU heap id(0 to MTMM_MAX_HEAPS-1), and returns 0 or -1 for a bad id.
+
+usedBytes		the bytes of the heap's used blocks(blocks in threads' caches count as used)
+heldBytes		the bytes of blocks in the heap's superblocks
+superblocks		the number of superblocks the heap holds
+transfersToGlobal	the number of superblocks moved from the heap to the global heap
+transfersFromGlobal	the number of superblocks moved from the global heap to the heap
+boundThreads		the number of threads bound to the heap
+*/
+#define MTMM_MAX_HEAPS 64
+
+typedef struct sMtmmHeapStats
+{
+	unsigned long usedBytes;
+	unsigned long heldBytes;
+	unsigned long superblocks;
+	unsigned long transfersToGlobal;
+	unsigned long transfersFromGlobal;
+	unsigned int boundThreads;
+} mtmmHeapStats;
+
+int mtmm_thread_bind_heap(int id);
+int mtmm_thread_private_heap(void);
+int mtmm_get_heap_stats(unsigned int id, mtmmHeapStats *stats);
+
+
+/*
+
+Mesh the superblocks of every heap(only when the mesh tunable is set).
+Two superblocks of the same size class, at most half full, whose live blocks are at different offsets are merged:
+the live blocks of one are copied into the other and its addresses are remapped onto the other's physical pages,
+so pointers stay valid while the pages of one superblock go back to the OS. Empty superblocks are released as well.
+Writes to a superblock that is being meshed wait until it is remapped, system calls' writes fail instead(see the mesh tunable).
+
+Returns the number of bytes of physical memory released.
+*/
+size_t mtmm_mesh(void);
+
+
+/*
+
+Allocation tags. mtmm_set_tag() sets the calling thread's current tag(0 to MTMM_MAX_TAGS-1, 0 by default), and the
+blocks it allocates with malloc() are accounted to that tag until they're freed, whichever thread frees them.
+Allocations are sampled(see the sample tunable) so mtmm_tag_bytes() returns an estimate of the bytes a tag holds,
+good for the components that hold many times the sampling interval.
+*/
+#define MTMM_MAX_TAGS 64
+
+void mtmm_set_tag(unsigned int tag);
+unsigned int mtmm_get_tag(void);
+size_t mtmm_tag_bytes(unsigned int tag);
+
+
+/*
+
+Private heaps. A private heap has its own size classes, so a subsystem that allocates from it doesn't fragment
+the memory of the rest of the program, and all of its memory can be released at once.
+mtmm_heap_create() takes options, or NULL for the defaults:
+
+limit		the max bytes of memory the heap may hold(whole superblocks and large blocks), 0 for no limit.
+		mtmm_heap_malloc() returns NULL with errno set to ENOMEM once the heap would pass it
+
+mtmm_heap_free() frees a block of the heap(free() works as well), a block of another heap is reported on stderr and ignored.
+mtmm_heap_destroy() releases every block of the heap in time proportional to its superblocks and large blocks, not its blocks.
+The heap's blocks mustn't be used afterwards, and the heap mustn't be used concurrently with its destruction.
+A private heap's blocks are never kept in the threads' caches, and its superblocks aren't meshed.
+*/
+typedef struct sMtmmHeapOptions
+{
+	size_t limit;
+} mtmmHeapOptions;
+
+typedef struct sMtmmHeap mtmm_heap_t;
+
+mtmm_heap_t * mtmm_heap_create(const mtmmHeapOptions *options);
+void * mtmm_heap_malloc(mtmm_heap_t *heap, size_t sz);
+void mtmm_heap_free(mtmm_heap_t *heap, void *ptr);
+void mtmm_heap_destroy(mtmm_heap_t *heap);
+
+
+/*
+
+Arenas for short lived memory, like a request's temporaries. mtmm_arena_alloc() bumps a pointer through superblocks
+taken from the same supply malloc uses, its blocks are 16 byte aligned and can't be freed one by one.
+Blocks bigger than the threshold tunable come from malloc. mtmm_arena_reset() releases every block of the arena at once,
+its superblocks go back to the supply and the arena can be used again. mtmm_arena_end() resets the arena and frees it.
+An arena isn't thread safe, each thread should use its own.
+*/
+typedef struct sMtmmArena mtmm_arena_t;
+
+mtmm_arena_t * mtmm_arena_begin(void);
+void * mtmm_arena_alloc(mtmm_arena_t *arena, size_t sz);
+void mtmm_arena_reset(mtmm_arena_t *arena);
+void mtmm_arena_end(mtmm_arena_t *arena);
+
+
+/*
+
+Epoch based reclamation for lock-free data structures.
+A thread that reads shared nodes does it between mtmm_epoch_enter() and mtmm_epoch_exit()(calls may nest).
+A node that was unlinked is passed to mtmm_retire() instead of free(), and is freed only once every thread
+that was inside a critical section when it was retired has left it. Retired blocks are kept in per-thread lists
+by epoch, and are freed in batches when the epoch advances. A pointer retired twice is freed twice.
+*/
+void mtmm_epoch_enter(void);
+void mtmm_epoch_exit(void);
+void mtmm_retire(void *ptr);
+
+
 
 #endif
 
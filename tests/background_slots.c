@@ -0,0 +1,49 @@
+/*
+A steady allocate/free loop must not keep opening new superblock slots while the background thread
+prefaults: the purged superblocks of the empty pool have to be reused first.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "../mtmm.h"
+
+#define BLOCKS (157 * (SUPERBLOCK_SIZE / 64))	/*about 157 superblocks of 64 byte blocks*/
+#define ROUNDS 33
+
+int main(int argc, char *argv[])
+{
+	static void *blocks[BLOCKS];
+	struct timespec pause = {0, 30 * 1000000L};	/*longer than the decay, so the pool is purged between rounds*/
+	unsigned long warmedUp = 0;
+	mtmmStats stats;
+	int round, i;
+	/*the tunables are read when the library is loaded*/
+	if(getenv("MTMM_CONF") == NULL)
+	{
+		setenv("MTMM_CONF", "background:5,decay:20", 1);
+		execv("/proc/self/exe", argv);
+		perror("execv");
+		return 1;
+	}
+	for(round = 0; round < ROUNDS; round++)
+	{
+		for(i = 0; i < BLOCKS; i++)
+			blocks[i] = malloc(64);
+		for(i = 0; i < BLOCKS; i++)
+			free(blocks[i]);
+		nanosleep(&pause, NULL);
+		mtmm_get_stats(&stats);
+		if(round == 2)
+			warmedUp = stats.superblockSlots;
+	}
+	printf("superblock slots: %lu after 3 rounds, %lu after %d rounds\n", warmedUp, stats.superblockSlots, ROUNDS);
+	/*a few slots of slack for the prefault reserve*/
+	if(stats.superblockSlots > warmedUp + 16)
+	{
+		printf("FAIL: the region keeps growing\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+The threads bound to a heap, and the ones that took a dedicated heap, must leave its count when they exit.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../mtmm.h"
+
+#define THREADS 10
+
+static void * bind_and_exit(void *unused)
+{
+	if(mtmm_thread_bind_heap(1) != 0)
+		return (void *)1;
+	free(malloc(64));
+	return NULL;
+}
+
+static void * dedicate_and_exit(void *unused)
+{
+	if(mtmm_thread_private_heap() < 0)
+		return (void *)1;
+	free(malloc(64));
+	return NULL;
+}
+
+/*the threads bound to any heap*/
+static unsigned long bound_threads()
+{
+	mtmmHeapStats stats;
+	unsigned long bound = 0;
+	unsigned int id;
+	for(id = 0; id < MTMM_MAX_HEAPS; id++)
+	{
+		mtmm_get_heap_stats(id, &stats);
+		bound += stats.boundThreads;
+	}
+	return bound;
+}
+
+/*run THREADS threads and check that no heap counts them once they're joined*/
+static int run(const char *name, void *(*body)(void *))
+{
+	pthread_t threads[THREADS];
+	void *failed;
+	int i, failures = 0;
+	for(i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, body, NULL);
+	for(i = 0; i < THREADS; i++)
+	{
+		pthread_join(threads[i], &failed);
+		failures += failed != NULL;
+	}
+	unsigned long bound = bound_threads();
+	printf("%s: %lu bound threads after %d exited\n", name, bound, THREADS);
+	return failures == 0 && bound == 0;
+}
+
+int main()
+{
+	int ok = run("bound to heap 1", bind_and_exit);
+	ok = run("dedicated heaps", dedicate_and_exit) && ok;
+	/*unbinding leaves no count either*/
+	mtmm_thread_bind_heap(0);
+	mtmm_thread_bind_heap(-1);
+	ok = ok && bound_threads() == 0;
+	printf(ok ? "ok\n" : "FAIL: a bound thread's count was left behind\n");
+	return !ok;
+}
@@ -0,0 +1,75 @@
+/*
+MTMM_CONF values that are negative, not whole numbers where a count is expected, or too big for their tunable must be
+reported and ignored rather than converted.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../mtmm.h"
+
+static const char *bad[] = {"tcache:1e12", "decay:-1", "locked:1e30", "tcache:1.5", "sample:nan", "heaps:0", "heaps:65",
+	"mesh:2", "exhausted:2.5", "sample:18446744073709551616", "prefault:4294967296"};
+static const char *good = "tcache:8,decay:0,sample:0,exhausted:2,threshold:1024,f:0.3";
+
+int main(int argc, char *argv[])
+{
+	char conf[1024], output[4096];
+	int pipeFds[2], status, ok = 1;
+	size_t i, length = 0;
+	ssize_t got;
+	/*the child only has to initialize the allocator*/
+	if(argc > 1)
+	{
+		free(malloc(16));
+		return 0;
+	}
+	strcpy(conf, good);
+	for(i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+	{
+		strcat(conf, ",");
+		strcat(conf, bad[i]);
+	}
+	if(pipe(pipeFds) != 0)
+	{
+		perror("pipe");
+		return 1;
+	}
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		dup2(pipeFds[1], STDERR_FILENO);
+		setenv("MTMM_CONF", conf, 1);
+		execl("/proc/self/exe", argv[0], "child", (char *)NULL);
+		_exit(1);
+	}
+	close(pipeFds[1]);
+	while(length < sizeof(output) - 1 && (got = read(pipeFds[0], output + length, sizeof(output) - 1 - length)) > 0)
+		length += got;
+	output[length] = '\0';
+	waitpid(pid, &status, 0);
+	for(i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+	{
+		char line[128];
+		snprintf(line, sizeof(line), "mtmm: bad MTMM_CONF entry \"%s\"\n", bad[i]);
+		if(strstr(output, line) == NULL)
+		{
+			printf("FAIL: %s wasn't reported\n", bad[i]);
+			ok = 0;
+		}
+	}
+	if(strstr(output, good) != NULL || strstr(output, "\"tcache:8\"") != NULL)
+	{
+		printf("FAIL: a good entry was reported\n");
+		ok = 0;
+	}
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		printf("FAIL: the child didn't exit cleanly\n");
+		ok = 0;
+	}
+	if(ok)
+		printf("ok\n");
+	return !ok;
+}